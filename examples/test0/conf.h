@@ -2,6 +2,31 @@
 
 #define DEV_FB_PATH "/dev/fb0"
 
+/* Render into memory instead of DEV_FB_PATH */
+//#define HEADLESS
+#define HEADLESS_XRES 1920
+#define HEADLESS_YRES 1080
+#define HEADLESS_STRIDE 0 /* in pixels, 0 -> HEADLESS_XRES */
+/* HEADLESS frames go to this file standing in for the device, in
+ * HEADLESS_FB_BPP pixels: 16 (RGB565), 24 or 32 */
+//#define HEADLESS_FB_FILE "/dev/shm/test0.fb"
+#define HEADLESS_FB_BPP 32
+/* SYNC writes each frame on the render thread, ASYNC maps the device
+ * and presents from a thread while the next frame renders */
+#define FB_PRESENT FbPresentType::ASYNC
+/* Dump every DUMP_PPM_STEP frame, printf-like path with frame number */
+//#define DUMP_PPM_PATH "test0_%04d.ppm"
+#define DUMP_PPM_STEP 50
+
+/* Texel storage: LINEAR, BLOCK (4x4 texels per cache line) or BC1
+ * (4x4 texels in 8 bytes, lossy, decoded in the shader). Built at the
+ * first load with it and kept ready in the .wfcache with the mips */
+#define TEX_LAYOUT TexLayout::BLOCK
+/* Mip chain, levels picked per pixel from screen space tex derivatives */
+#define TEX_MIPMAPS false
+/* NEAREST, BILINEAR or TRILINEAR, filtering removes the A6M shimmering
+ * but costs 4-8 gathers per pixel instead of one */
+#define TEX_FILTER TexFilter::NEAREST
 /* Linear textures, acceptable for highpoly models */
 #define HACK_TRINTERP_LINEAR
 /* Textures boundary check, protection for bad texture mappings */
@@ -12,9 +37,28 @@
 
 #define DRAW_SKY
 #define DRAW_A6M
+/* Vertex + index buffers, vertices are shaded once per frame */
+#define INDEXED_DRAW
+/* Reorder triangles for a vertex cache of this size after every load,
+ * cached meshes included, prints ACMR and overdraw */
+//#define OPTIMIZE_MESH 16
+/* A6M first, then sky depth tested against it through DepthTarget,
+ * pays off when hidden pixels cost more to shade than to depth test */
+//#define SHARED_DEPTH
 //#define N_THREADS 4
-#define N_THREADS (std::thread::hardware_concurrency())
+/* hardware_concurrency() is 0 when unknown */
+#define N_THREADS (std::max(1u, std::thread::hardware_concurrency()))
+/* Spin/futex threadpool barrier, main thread works as one of N_THREADS */
+#define SYNC_TP_SPIN_FUTEX
 #define DRAWBACK
+/* DIRECT or STREAM, tiles stored with non-temporal stores keep the frame
+ * out of the caches, compare llc_miss of DrawBinRoutine with -DPERF_LLC */
+#ifndef RESOLVE
+#define RESOLVE PipelineResolveType::DIRECT
+#endif
+/* Present only tiles the pipelines drew, the sky covers the whole frame
+ * here, so it only pays off for scenes with a static background */
+//#define DIRTY_TILES
 #define N_FRAMES 500
 
 #define TILE_SIZE 16
@@ -4,34 +4,90 @@
 #include <include/mouse.h>
 #include <include/tr_pipeline.h>
 #include <include/wfobj.h>
+#include <include/mesh_opt.h>
 #include <iostream>
 #include <chrono>
 #include <utility>
+#include <cstdio>
 
 struct Model {
+#ifdef INDEXED_DRAW
+	std::vector<Vertex> verts;
+	std::vector<uint32_t> inds;
+#else
 	std::vector<std::array<Vertex, 3>> prim_buf;
-	PpmImg *tex;
+#endif
+	Texture tex;
 	float scale;
+
+	void set_mesh(Wfobj const &obj)
+	{
+#ifdef INDEXED_DRAW
+		verts = obj.mesh.verts;
+		inds = obj.mesh.inds;
+#else
+		obj.get_prim_buf(prim_buf);
+#endif
+	}
 };
 
+template <typename _pipe>
+void DrawModel(_pipe &pipe, Model const &model, Mat4 const &view,
+	Fbuffer &fb)
+{
+	pipe.shader.set_view(view, model.scale);
+#ifdef INDEXED_DRAW
+	pipe.Accumulate(model.verts, model.inds);
+#else
+	pipe.Accumulate(model.prim_buf);
+#endif
+	pipe.Render(&(fb.buf[0]), fb.stride);
+}
+
 int main(int argc, char *argv[])
 {
 	Fbuffer fb;
-	if (fb.Init(DEV_FB_PATH) < 0) {
+#if defined(HEADLESS) && defined(HEADLESS_FB_FILE)
+	if (fb.InitFile(HEADLESS_FB_FILE, HEADLESS_XRES, HEADLESS_YRES,
+			HEADLESS_STRIDE, FB_PRESENT, HEADLESS_FB_BPP) < 0) {
+		perror(HEADLESS_FB_FILE);
+		return 1;
+	}
+#elif defined(HEADLESS)
+	if (fb.InitOffscreen(HEADLESS_XRES, HEADLESS_YRES,
+			     HEADLESS_STRIDE) < 0) {
+		perror("offscreen");
+		return 1;
+	}
+#else
+	if (fb.Init(DEV_FB_PATH, FB_PRESENT) < 0) {
 		perror(DEV_FB_PATH);
 		return 1;
 	}
+#endif
 	Model sky, a6m;
 
 	std::vector<Wfobj> obj_buf;
-	assert(!ImportWfobj(SKY_OBJ_PATH, obj_buf));
-	assert(!ImportWfobj(A6M_OBJ_PATH, obj_buf));
+	WfobjTexFormat const tex_fmt = { TEX_LAYOUT, TEX_MIPMAPS };
+	assert(!ImportWfobj(SKY_OBJ_PATH, obj_buf, tex_fmt));
+	assert(!ImportWfobj(A6M_OBJ_PATH, obj_buf, tex_fmt));
+#ifdef OPTIMIZE_MESH
+	for (auto &obj : obj_buf) {
+		float const acmr = MeshAcmr(obj.mesh, OPTIMIZE_MESH);
+		float const overdraw = MeshOverdraw(obj.mesh);
+		MeshOptimize(obj.mesh, OPTIMIZE_MESH);
+		std::cout << obj.name << " ACMR " << acmr << " -> " <<
+			MeshAcmr(obj.mesh, OPTIMIZE_MESH) << ", overdraw " <<
+			overdraw << " -> " << MeshOverdraw(obj.mesh) <<
+			std::endl;
+	}
+#endif
 
-	obj_buf[0].get_prim_buf(sky.prim_buf);
-	obj_buf[1].get_prim_buf(a6m.prim_buf);
+	sky.set_mesh(obj_buf[0]);
+	a6m.set_mesh(obj_buf[1]);
 
-	sky.tex = &obj_buf[0].mtl.tex_img;
-	a6m.tex = &obj_buf[1].mtl.tex_img;
+	sky.tex = std::move(obj_buf[0].mtl.tex);
+	a6m.tex = std::move(obj_buf[1].mtl.tex);
 
 	sky.scale = SKY_SCALE;
 	a6m.scale = A6M_SCALE;
@@ -45,27 +101,61 @@ int main(int argc, char *argv[])
 	Vec3 up  {0, 1, 0};
 	Mat4 view0 = MakeMat4LookAt(eye, at, up);
 
+#ifdef SYNC_TP_SPIN_FUTEX
+	SyncThreadpool sync_tp(SyncThreadpoolBarrierType::SPIN_FUTEX, true);
+	sync_tp.add_concurrency(N_THREADS - 1);
+#else
 	SyncThreadpool sync_tp;
 	sync_tp.add_concurrency(N_THREADS);
+#endif
+
+#ifdef DIRTY_TILES
+	FbDirtyTiles dirty;
+	dirty.Init(fb.xres, fb.yres, TILE_SIZE);
+#endif
+#ifdef SHARED_DEPTH
+	DepthTarget depth;
+	depth.set_window(wnd);
+	auto constexpr sky_hiz  = TrCoarseRastHizType::ACTIVE;
+	auto constexpr sky_zbuf = TrFineRastZbufType::ACTIVE;
+#else
+	auto constexpr sky_hiz  = TrCoarseRastHizType::DISABLED;
+	auto constexpr sky_zbuf = TrFineRastZbufType::DISABLED;
+#endif
 
 #ifdef DRAW_SKY
 	Pipeline<TexShader, TrSetupFrontCulling, TrBinRast,
-		TrCoarseRast, TrFineRast<TrFineRastZbufType::DISABLED>,
+		TrCoarseRast<sky_hiz>,
+		TrFineRast<sky_zbuf>,
 		TrInterp<TrInterpType::TEXTURE>> tex_pipe;
 
-	tex_pipe.shader.set_tex_img(sky.tex);
+	tex_pipe.shader.set_tex(&sky.tex, TEX_FILTER);
 	tex_pipe.set_window(wnd);
 	tex_pipe.set_sync_tp(&sync_tp);
-
+	tex_pipe.set_resolve(RESOLVE);
+#ifdef SHARED_DEPTH
+	tex_pipe.set_depth_target(&depth);
+#endif
+#ifdef DIRTY_TILES
+	tex_pipe.set_dirty_target(&dirty);
+#endif
 #endif
 #ifdef DRAW_A6M
 	Pipeline<TexHighlShader, TrSetupBackCulling, TrBinRast,
-		TrCoarseRast, TrFineRast<TrFineRastZbufType::ACTIVE>,
+		TrCoarseRast<TrCoarseRastHizType::ACTIVE>,
+		TrFineRast<TrFineRastZbufType::ACTIVE>,
 		TrInterp<TrInterpType::ALL>> hgl_pipe;
 
-	hgl_pipe.shader.set_tex_img(a6m.tex);
+	hgl_pipe.shader.set_tex(&a6m.tex, TEX_FILTER);
 	hgl_pipe.set_window(wnd);
 	hgl_pipe.set_sync_tp(&sync_tp);
+	hgl_pipe.set_resolve(RESOLVE);
+#ifdef SHARED_DEPTH
+	hgl_pipe.set_depth_target(&depth);
+#endif
+#ifdef DIRTY_TILES
+	hgl_pipe.set_dirty_target(&dirty);
+#endif
 #endif
 #ifdef MOUSE_ROTATE
 	Mouse ms;
@@ -75,7 +165,7 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 	float xrot = 0, yrot = 0;
-	while (1) {
+	for (int i = 0;; ++i) {
 		float const rotspd = MOUSE_ROTSPD;
 		while (!ms.Poll(ms_event))
 			/* repeat */;
@@ -90,26 +180,50 @@ int main(int argc, char *argv[])
 		Mat4 view = view0 * MakeMat4Rotate(Vec3{0,1,0}, (i+1) * rotspd);
 		auto const t0 = std::chrono::system_clock::now();
 #endif
+#ifdef SHARED_DEPTH
+		depth.Clear();
+#ifdef DRAW_A6M
+		DrawModel(hgl_pipe, a6m, view, fb);
+#endif
+#endif
 #ifdef DRAW_SKY
-		tex_pipe.shader.set_view(view, sky.scale);
-		tex_pipe.Accumulate(sky.prim_buf);
-		tex_pipe.Render(&(fb.buf[0]));
+		DrawModel(tex_pipe, sky, view, fb);
 #endif
-#ifdef DRAW_A6M
-		hgl_pipe.shader.set_view(view, a6m.scale);
-		hgl_pipe.Accumulate(a6m.prim_buf);
-		hgl_pipe.Render(&(fb.buf[0]));
+#if defined(DRAW_A6M) && !defined(SHARED_DEPTH)
+		DrawModel(hgl_pipe, a6m, view, fb);
 #endif
 #ifndef MOUSE_ROTATE
 		auto const t1 = std::chrono::system_clock::now();
 		std::chrono::duration<double, std::milli> const dt = t1 - t0;
 		std::cout << dt.count() << std::endl;
 #endif
+#ifdef DUMP_PPM_PATH
+		if (i % DUMP_PPM_STEP == 0) {
+			char path[256];
+			snprintf(path, sizeof(path), DUMP_PPM_PATH, i);
+			if (fb.DumpPpm(path) < 0)
+				perror(path);
+		}
+#endif
 #ifdef DRAWBACK
+#ifdef DIRTY_TILES
+		fb.Update(dirty);
+#else
 		fb.Update();
+#endif
 		//fb.Clear();
 #endif
 	}
+#ifdef PERF_STATS
+#ifdef DRAW_SKY
+	std::cout << "sky pipeline stats:" << std::endl;
+	tex_pipe.print_stats(std::cout);
+#endif
+#ifdef DRAW_A6M
+	std::cout << "a6m pipeline stats:" << std::endl;
+	hgl_pipe.print_stats(std::cout);
+#endif
+#endif
 
 	return 0;
 }
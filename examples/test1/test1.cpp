@@ -3,10 +3,28 @@
 //#define HACK_DRAWBIN_NO_DRAWBACK
 
 //#define N_THREADS 1
-#define N_THREADS std::thread::hardware_concurrency()
+/* hardware_concurrency() is 0 when unknown */
+#define N_THREADS (std::max(1u, std::thread::hardware_concurrency()))
+/* Spin/futex threadpool barrier, main thread works as one of N_THREADS */
+#define SYNC_TP_SPIN_FUTEX
 #define DRAWBACK
+/* Background written by the pipeline per tile, no full frame Clear */
+#define FUSED_CLEAR
+/* DIRECT or STREAM tile stores, see PipelineResolveType */
+#ifndef RESOLVE
+#define RESOLVE PipelineResolveType::DIRECT
+#endif
 #define N_FRAMES 300
 
+/* Render into memory instead of /dev/fb0 */
+//#define HEADLESS
+#define HEADLESS_XRES 1920
+#define HEADLESS_YRES 1080
+#define HEADLESS_STRIDE 0 /* in pixels, 0 -> HEADLESS_XRES */
+/* Dump every DUMP_PPM_STEP frame, printf-like path with frame number */
+//#define DUMP_PPM_PATH "test1_%04d.ppm"
+#define DUMP_PPM_STEP 50
+
 #define TILE_SIZE 16
 #define BIN_SIZE 8
 
@@ -17,6 +35,7 @@
 #include <iostream>
 #include <chrono>
 #include <utility>
+#include <cstdio>
 
 #include "raycast.hpp"
 
@@ -73,6 +92,135 @@ struct MyShader final : public Shader<Vec2, Vertex, Fbuffer::Color> {
 				       uint8_t(color.y * 255),
 				       uint8_t(color.z * 255), 255 };
 	}
+#ifdef SIMD_PACK
+	using S = SimdPack;
+	using F = S::F;
+
+	struct Vec3Pack {
+		F x, y, z;
+	};
+
+	static F DotPack(Vec3Pack const &a, Vec3Pack const &b)
+	{
+		return S::fmadd(a.x, b.x, S::fmadd(a.y, b.y,
+				S::mul(a.z, b.z)));
+	}
+
+	static Vec3Pack NormalizePack(Vec3Pack const &v)
+	{
+		F len = S::sqrt(DotPack(v, v));
+		return { S::div(v.x, len), S::div(v.y, len),
+			 S::div(v.z, len) };
+	}
+
+	static Vec3Pack Set1(Vec3 const &v)
+	{
+		return { S::set1(v.x), S::set1(v.y), S::set1(v.z) };
+	}
+
+	/* Same as FindIntersection for a ray per lane: t and hit mask,
+	 * color and center of the nearest sphere */
+	static F Intersect(Vec3Pack const &pos, Vec3Pack const &dir,
+		PackMask &hit, Vec3Pack *color, Vec3Pack *center)
+	{
+		F depth = S::set1(1e6f);
+		F const dmin = S::set1(1e-3f);
+		F const zero = S::set1(0.f);
+		hit = 0;
+		for (int i = 0; i < sph_size; i++) {
+			Sphere const &s = sph[i];
+			Vec3Pack rp = { S::sub(pos.x, S::set1(s.pos.x)),
+					S::sub(pos.y, S::set1(s.pos.y)),
+					S::sub(pos.z, S::set1(s.pos.z)) };
+			F ra_rp = DotPack(dir, rp);
+			F d = S::fmadd(ra_rp, ra_rp, S::sub(
+				S::set1(s.R * s.R), DotPack(rp, rp)));
+			PackMask valid = ~S::gt(ra_rp, zero) &
+					 ~S::lt(d, zero);
+			F t = S::sub(S::sub(zero, ra_rp),
+				     S::sqrt(S::max(d, zero)));
+			PackMask near = valid & S::gt(t, dmin) &
+					S::lt(t, depth);
+			depth = S::blend(near, depth, t);
+			hit |= near;
+			if (color) {
+				Vec3Pack c = Set1(s.color);
+				color->x = S::blend(near, color->x, c.x);
+				color->y = S::blend(near, color->y, c.y);
+				color->z = S::blend(near, color->z, c.z);
+			}
+			if (center) {
+				Vec3Pack c = Set1(s.pos);
+				center->x = S::blend(near, center->x, c.x);
+				center->y = S::blend(near, center->y, c.y);
+				center->z = S::blend(near, center->z, c.z);
+			}
+		}
+		return depth;
+	}
+
+	void FShaderPack(FsInPack const &in, PackMask mask,
+			Fbuffer::Color *out) const override
+	{
+		F const zero = S::set1(0.f);
+
+		/* CastFromCam */
+		Vec3 const n = Normalize(cam.at - cam.pos);
+		Vec3 const right = CrossProd(n, cam.up);
+		Vec3 const up = CrossProd(right, n);
+		Vec3 const dx = (cam.fov * cam.ratio) * Normalize(right);
+		Vec3 const dy = cam.fov * Normalize(up);
+		Vec3Pack dir = NormalizePack({
+			S::fmadd(in.pos[0], S::set1(dx.x),
+				S::fmadd(in.pos[1], S::set1(dy.x), S::set1(n.x))),
+			S::fmadd(in.pos[0], S::set1(dx.y),
+				S::fmadd(in.pos[1], S::set1(dy.y), S::set1(n.y))),
+			S::fmadd(in.pos[0], S::set1(dx.z),
+				S::fmadd(in.pos[1], S::set1(dy.z), S::set1(n.z)))});
+
+		PackMask hit;
+		Vec3Pack color = { zero, zero, zero };
+		Vec3Pack center = { zero, zero, zero };
+		F t = Intersect(Set1(cam.pos), dir, hit, &color, &center);
+
+		Vec3Pack pos = { S::fmadd(t, dir.x, S::set1(cam.pos.x)),
+				 S::fmadd(t, dir.y, S::set1(cam.pos.y)),
+				 S::fmadd(t, dir.z, S::set1(cam.pos.z)) };
+		PackMask shadow;
+		Vec3Pack light_v = Set1(light);
+		Intersect(pos, light_v, shadow, nullptr, nullptr);
+		shadow &= hit;
+
+		Vec3Pack norm = NormalizePack({ S::sub(pos.x, center.x),
+					    S::sub(pos.y, center.y),
+					    S::sub(pos.z, center.z) });
+		Vec3Pack halfway = NormalizePack({ S::sub(light_v.x, dir.x),
+					       S::sub(light_v.y, dir.y),
+					       S::sub(light_v.z, dir.z) });
+		F spec = S::max(zero, DotPack(norm, halfway));
+		for (int i = 0; i < 4; i++)
+			spec = S::mul(spec, spec);
+		F diff = S::max(zero, DotPack(norm, light_v));
+		F k = S::fmadd(S::set1(0.4f), diff, S::fmadd(S::set1(0.3f),
+				spec, S::set1(0.3f)));
+		F k_x = S::blend(shadow, k, S::set1(0.8f));
+		F k_yz = S::blend(shadow, k, S::set1(0.3f));
+
+		/* Misses are Fbuffer::Color{ 100, 25, 25, 255 } */
+		F c255 = S::set1(255.f);
+		F b = S::blend(hit, S::set1(100.f),
+			       S::mul(S::mul(color.x, k_x), c255));
+		F g = S::blend(hit, S::set1(25.f),
+			       S::mul(S::mul(color.y, k_yz), c255));
+		F r = S::blend(hit, S::set1(25.f),
+			       S::mul(S::mul(color.z, k_yz), c255));
+
+		S::I c = S::ori(S::cvtt(b), S::slli(S::cvtt(g), 8));
+		c = S::ori(c, S::slli(S::cvtt(r), 16));
+		c = S::ori(c, S::seti(int32_t(0xff000000)));
+		S::storei(out, c, mask);
+	}
+#endif
 	void set_view(Mat4 const &view, float scale) override
 	{
 	}
@@ -97,15 +245,37 @@ struct RaySetup : public Setup<RayPrim, TrData, _shader> {
 	using In = typename Base::In;
 	using Data = typename Base::Data;
 	using _Shader = typename Base::_Shader;
-	void Process(In const &in, std::vector<Data> &out) const override
+	using VsOut = typename Base::VsOut;
+	uint32_t Process(In const &in, Data *out) const override
 	{
-		Data data;
+		Data &data = *out;
 		for (int i = 0; i < in.size(); ++i) {
 			auto vs_out = Base::shader.VShader(in[i]);
 			data[i].pos = vs_out.pos;
 			data[i].fs_vtx = vs_out.fs_vtx;
 		}
+		return Assemble(data);
+	}
 
+	uint32_t ProcessShaded(VsOut const *vtx, uint32_t const *ind,
+			Data *out) const override
+	{
+		Data &data = *out;
+		for (int i = 0; i < 3; ++i) {
+			data[i].pos = vtx[ind[i]].pos;
+			data[i].fs_vtx = vtx[ind[i]].fs_vtx;
+		}
+		return Assemble(data);
+	}
+
+	void set_window(Window const &wnd) override
+	{
+		/* Nothing */
+	}
+
+private:
+	uint32_t Assemble(Data &data) const
+	{
 		Vec3 tr[3] = { ReinterpVec3(data[0].pos),
 			       ReinterpVec3(data[1].pos),
 			       ReinterpVec3(data[2].pos) };
@@ -118,10 +288,10 @@ struct RaySetup : public Setup<RayPrim, TrData, _shader> {
 		float det = d1.x * d2.y - d1.y * d2.x;
 		if (_type == decltype(_type)::BACK) {
 			if (det >= 0)
-				return;
+				return 0;
 		} else if (_type == decltype(_type)::FRONT) {
 			if (det <= 0)
-				return;
+				return 0;
 			auto tmp = data[0];
 			data[0] = data[2];
 			data[2] = tmp;
@@ -132,12 +302,7 @@ struct RaySetup : public Setup<RayPrim, TrData, _shader> {
 				data[2] = tmp;
 			}
 		}
-		out.push_back(data);
-	}
-
-	void set_window(Window const &wnd) override
-	{
-		/* Nothing */
+		return 1;
 	}
 };
 
@@ -176,10 +341,18 @@ std::vector<RayPrim> MakeRayPrimBuf(Vec2 const *verts, unsigned const *inds,
 int main(int argc, char *argv[])
 {
 	Fbuffer fb;
+#ifdef HEADLESS
+	if (fb.InitOffscreen(HEADLESS_XRES, HEADLESS_YRES,
+			     HEADLESS_STRIDE) < 0) {
+		perror("offscreen");
+		return 1;
+	}
+#else
 	if (fb.Init("/dev/fb0") < 0) {
 		perror("fb0");
 		return 1;
 	}
+#endif
 
 	float z_avg = 1;
 	Window wnd = { .x = 0,
@@ -189,13 +362,23 @@ int main(int argc, char *argv[])
 		       .f = z_avg * 100,
 		       .n = z_avg / 100 };
 
+#ifdef SYNC_TP_SPIN_FUTEX
+	SyncThreadpool sync_tp(SyncThreadpoolBarrierType::SPIN_FUTEX, true);
+	sync_tp.add_concurrency(N_THREADS - 1);
+#else
 	SyncThreadpool sync_tp;
 	sync_tp.add_concurrency(N_THREADS);
-	Pipeline<MyShader, RaySetupBackCulling, TrBinRast, TrCoarseRast,
+#endif
+	Pipeline<MyShader, RaySetupBackCulling, TrBinRast,
+		 TrCoarseRast<TrCoarseRastHizType::ACTIVE>,
 		 TrFineRast<TrFineRastZbufType::ACTIVE>,
 		 TrInterp<TrInterpType::POS>> pipe;
 	pipe.set_window(wnd);
 	pipe.set_sync_tp(&sync_tp);
+	pipe.set_resolve(RESOLVE);
+#ifdef FUSED_CLEAR
+	pipe.set_clear_color(Fbuffer::Color{ 0, 0, 0, 0 });
+#endif
 
 	auto prim_buf =
 		MakeRayPrimBuf(verts, inds, sizeof(inds) / sizeof(*inds));
@@ -218,15 +401,29 @@ int main(int argc, char *argv[])
 		auto const t0 = std::chrono::system_clock::now();
 
 		pipe.Accumulate(prim_buf);
-		pipe.Render(&(fb.buf[0]));
+		pipe.Render(&(fb.buf[0]), fb.stride);
 
 		auto const t1 = std::chrono::system_clock::now();
 		std::chrono::duration<double, std::milli> const dt = t1 - t0;
 		std::cout << dt.count() << std::endl;
+#ifdef DUMP_PPM_PATH
+		if (i % DUMP_PPM_STEP == 0) {
+			char path[256];
+			snprintf(path, sizeof(path), DUMP_PPM_PATH, i);
+			if (fb.DumpPpm(path) < 0)
+				perror(path);
+		}
+#endif
 #ifdef DRAWBACK
 		fb.Update();
+#ifndef FUSED_CLEAR
 		fb.Clear();
+#endif
 #endif
 	}
+#ifdef PERF_STATS
+	std::cout << "pipeline stats:" << std::endl;
+	pipe.print_stats(std::cout);
+#endif
 	return 0;
 }
@@ -0,0 +1,64 @@
+#define TILE_SIZE 16
+#define BIN_SIZE 4
+
+#include <include/shaders.h>
+
+#include <cstdlib>
+#include <iostream>
+
+/* Samples every texel center of mip level 1, BILINEAR has to return
+ * the texel itself there */
+int check_bilinear_level(TexLayout layout, char const *name)
+{
+#ifdef SIMD_PACK
+	using S = SimdPack;
+	PpmImg img;
+	img.w = img.h = 16;
+	img.buf.resize(img.w * img.h);
+	for (auto &c : img.buf)
+		c = PpmImg::Color { uint8_t(rand()), uint8_t(rand()),
+				    uint8_t(rand()), 255 };
+	Texture tex;
+	tex.Import(img, layout, true);
+
+	TexShader shader;
+	shader.set_tex(&tex, TexFilter::BILINEAR);
+	int32_t const lw = tex.lvl_w[1], lh = tex.lvl_h[1];
+	int n_bad = 0;
+	for (int32_t y = 0; y < lh; ++y) {
+		for (int32_t x0 = 0; x0 < lw; x0 += PackWidth) {
+			alignas(64) float tu[PackWidth], tv[PackWidth];
+			for (int i = 0; i < PackWidth; ++i) {
+				tu[i] = ((x0 + i) % lw + 0.5f) / lw;
+				tv[i] = 1 - (y + 0.5f) / lh;
+			}
+			TexShader::FsInPack in = {};
+			in.tex[0] = S::load(tu);
+			in.tex[1] = S::load(tv);
+			/* Two level 0 texels per pixel -> level 1 */
+			in.tex_dx[0] = S::set1(2.f / tex.w);
+			in.tex_dx[1] = S::set1(0);
+			in.tex_dy[0] = S::set1(0);
+			in.tex_dy[1] = S::set1(2.f / tex.h);
+			Fbuffer::Color out[PackWidth];
+			shader.FShaderPack(in, S::full, out);
+			for (int i = 0; i < PackWidth; ++i) {
+				auto c = tex.get((x0 + i) % lw, y, 1);
+				auto o = out[i];
+				n_bad += o.b != c.b || o.g != c.g || o.r != c.r;
+			}
+		}
+	}
+	std::cout << name << ": " << n_bad << " wrong texels" << std::endl;
+	return n_bad;
+#else
+	return 0;
+#endif
+}
+
+int main()
+{
+	int n_bad = check_bilinear_level(TexLayout::LINEAR, "linear");
+	n_bad += check_bilinear_level(TexLayout::BLOCK, "block");
+	return n_bad != 0;
+}
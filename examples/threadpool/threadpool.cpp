@@ -2,6 +2,8 @@
 
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 
 std::atomic<int> my_counter;
@@ -15,13 +17,13 @@ void my_task(int id, int x)
 	thread_stat[id]++;
 }
 
-void test(int n)
+void test(int n, SyncThreadpoolBarrierType type, bool caller_runs)
 {
 	{
-		thread_stat.resize(n);
-		SyncThreadpool tp;
+		SyncThreadpool tp(type, caller_runs);
 		tp.add_concurrency(n / 2);
 		tp.add_concurrency(n - n / 2);
+		thread_stat.assign(tp.get_concurrency(), 0);
 
 		my_counter = 0;
 
@@ -34,16 +36,54 @@ void test(int n)
 
 	std::cout << std::flush << std::endl <<
 		"Done: " << my_counter << std::endl;
-	for (int i = 0; i < n; ++i)
+	for (int i = 0; i < thread_stat.size(); ++i)
 		std::cout << "thread[" << i << "] " <<
 			thread_stat[i] << std::endl;
 }
 
+void empty_task(int id, int x)
+{
+}
+
+/* Round trip of run() + wait_completion() with trivial tasks, like
+ * back-to-back Pipeline stages */
+void bench(int n, SyncThreadpoolBarrierType type, bool caller_runs,
+	   char const *name)
+{
+	int const n_stages = 20000;
+	SyncThreadpool tp(type, caller_runs);
+	tp.add_concurrency(n);
+
+	auto const t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < n_stages; ++i) {
+		tp.set_tasks(empty_task, tp.get_concurrency());
+		tp.run();
+		tp.wait_completion();
+	}
+	auto const t1 = std::chrono::steady_clock::now();
+	std::chrono::duration<double, std::micro> const dt = t1 - t0;
+	std::cout << name << ": " << dt.count() / n_stages
+		  << " us/stage" << std::endl;
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2)
-		std::cout << "Usage: argv[1] = n_threads" << std::endl;
-	else
-		test(atoi(argv[1]));
+	if (argc < 2) {
+		std::cout << "Usage: argv[1] = n_threads, "
+			     "argv[2] = \"bench\" (optional)" << std::endl;
+		return 0;
+	}
+	int n = atoi(argv[1]);
+	if (argc > 2 && !strcmp(argv[2], "bench")) {
+		bench(n, SyncThreadpoolBarrierType::CONDVAR, false,
+		      "condvar");
+		bench(n, SyncThreadpoolBarrierType::SPIN_FUTEX, false,
+		      "spin_futex");
+		bench(n, SyncThreadpoolBarrierType::SPIN_FUTEX, true,
+		      "spin_futex + caller");
+	} else {
+		test(n, SyncThreadpoolBarrierType::CONDVAR, false);
+		test(n, SyncThreadpoolBarrierType::SPIN_FUTEX, true);
+	}
 	return 0;
 }
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <include/tile.h>
+#include <include/geom.h>
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+/* Depth kept between pipelines within a frame, laid out by tiles.
+ * Clear is O(1): a tile holds data only if written after the last one */
+struct DepthTarget {
+	uint32_t w_tiles = 0;
+	uint32_t h_tiles = 0;
+
+	void set_window(Window const &wnd)
+	{
+		w_tiles = DivRoundUp(wnd.w, TILE_SIZE);
+		h_tiles = DivRoundUp(wnd.h, TILE_SIZE);
+		tiles.resize(w_tiles * h_tiles);
+		tile_min.resize(w_tiles * h_tiles);
+		tile_gen.assign(w_tiles * h_tiles, 0);
+		gen = 1;
+	}
+
+	void Clear()
+	{
+		if (++gen == 0) {
+			std::fill(tile_gen.begin(), tile_gen.end(), 0);
+			gen = 1;
+		}
+	}
+
+	uint32_t get_tile_id(Vec2i const &tile) const
+	{
+		return tile.x + tile.y * w_tiles;
+	}
+
+	/* nullptr -> not written since Clear */
+	float const *Load(uint32_t tile_id) const
+	{
+		if (tile_gen[tile_id] != gen)
+			return nullptr;
+		return tiles[tile_id].data();
+	}
+
+	float *get_tile(uint32_t tile_id)
+	{
+		return tiles[tile_id].data();
+	}
+
+	/* Marks tile written, min is its farthest depth */
+	void Commit(uint32_t tile_id, float min)
+	{
+		tile_min[tile_id] = min;
+		tile_gen[tile_id] = gen;
+	}
+
+	bool get_min(uint32_t tile_id, float &min) const
+	{
+		if (tile_gen[tile_id] != gen)
+			return false;
+		min = tile_min[tile_id];
+		return true;
+	}
+
+private:
+	std::vector<Tile<float>> tiles;
+	std::vector<float>    tile_min;
+	std::vector<uint32_t> tile_gen;
+	uint32_t gen = 1;
+};
@@ -1,51 +1,165 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 extern "C" {
 #include <linux/fb.h>
 }
 
+enum class FbPresentType {
+	SYNC,	/* Update writes the frame with pwrite */
+	ASYNC,	/* target mapped, Update hands the frame to a present
+		 * thread and rendering goes on in a second buffer */
+};
+
+/* Tiles written since the last Update(FbDirtyTiles &), marked by the
+ * pipelines drawing the frame, one byte per tile */
+struct FbDirtyTiles {
+	std::uint32_t tile_size = 0;
+	std::uint32_t w_tiles = 0;
+	std::uint32_t h_tiles = 0;
+	std::vector<std::uint8_t> map;
+
+	void Init(std::uint32_t w, std::uint32_t h, std::uint32_t tile_size_)
+	{
+		tile_size = tile_size_;
+		w_tiles = (w + tile_size - 1) / tile_size;
+		h_tiles = (h + tile_size - 1) / tile_size;
+		map.assign(w_tiles * h_tiles, 0);
+	}
+
+	void Mark(std::uint32_t tile_x, std::uint32_t tile_y)
+	{
+		if (tile_x < w_tiles && tile_y < h_tiles)
+			map[tile_x + tile_y * w_tiles] = 1;
+	}
+
+	void MarkAll()
+	{
+		std::fill(map.begin(), map.end(), 1);
+	}
+
+	void Reset()
+	{
+		std::fill(map.begin(), map.end(), 0);
+	}
+};
+
+enum class FbPixelFormat {
+	BGRA32,	/* render target layout, copied as is */
+	RGB16,	/* fields from the red, green, blue bitfields, e.g. RGB565 */
+	RGB24,	/* byte fields from the red, green, blue offsets */
+};
+
 struct Fbuffer : public fb_var_screeninfo, public fb_fix_screeninfo {
 	struct Color {
 		std::uint8_t b, g, r, a;
 	};
+	/* Pixel rectangle, ends exclusive */
+	struct Rect {
+		std::uint32_t x0, y0, x1, y1;
+	};
 
-	Color *buf;
+	Color *buf = nullptr;
+	std::uint32_t stride; /* in pixels */
 
 	Color *operator[](std::uint32_t);
 	Color const *operator[](std::uint32_t) const;
 
-	int Init(const char *path);
+	~Fbuffer();
+
+	int Init(const char *path,
+		 FbPresentType present_ = FbPresentType::SYNC);
+	/* Memory-only target, no device required. stride = 0 -> xres */
+	int InitOffscreen(std::uint32_t w, std::uint32_t h,
+			  std::uint32_t stride_ = 0);
+	/* Regular file standing in for the device, resized to the frame.
+	 * A memfd is passed as /proc/self/fd/N. bpp 16 -> RGB565,
+	 * 24 -> BGR888, 32 -> BGRA */
+	int InitFile(const char *path, std::uint32_t w, std::uint32_t h,
+		     std::uint32_t stride_ = 0,
+		     FbPresentType present_ = FbPresentType::SYNC,
+		     std::uint32_t bpp = 32);
 	int Destroy();
+	/* buf is the next frame's buffer afterwards. ASYNC only blocks
+	 * while the previous frame is still being presented and swaps
+	 * buffers, buf contents are undefined then: clear or redraw the
+	 * whole frame, or fully redraw the dirty tiles if the next update
+	 * is Update(FbDirtyTiles &). Nothing is copied on this thread */
 	int Update();
+	/* Writes only the dirty tiles, coalesced in row spans, and resets
+	 * dirty. Pixels out of them are not read from buf and keep what
+	 * was presented before. ASYNC copies the dirty tiles into the next
+	 * buf, so it holds the image just presented, except right after
+	 * an Update() */
+	int Update(FbDirtyTiles &dirty);
+	int DumpPpm(const char *path) const;
 
 	void Fill(Color c);
 	void Clear();
 
     private:
-	int fd;
+	int fd = -1;
+	FbPresentType present = FbPresentType::SYNC;
+
+	/* Device pixels, converted from buf on present unless BGRA32 */
+	FbPixelFormat format = FbPixelFormat::BGRA32;
+	std::uint32_t pix_size = sizeof(Color);
+	/* Device image for SYNC pwrite of converted formats */
+	std::vector<char> stage;
+
+	/* ASYNC state */
+	Color *back[2] = {};
+	/* Back buffer left undefined by a full Update() */
+	Color *stale = nullptr;
+	char *map = nullptr;
+	std::size_t map_size = 0;
+	std::thread present_thread;
+	std::mutex m_present;
+	std::condition_variable cv_present;
+	Color const *present_buf = nullptr;
+	std::vector<Rect> spans;
+	std::vector<Rect> present_spans;
+	bool present_pending = false;
+	bool present_finish = false;
+
+	void SetGeometry(std::uint32_t w, std::uint32_t h,
+			 std::uint32_t stride_, std::uint32_t bpp);
+	int SetPixelFormat();
+	void ConvertRow(char *dst, Color const *src, std::uint32_t n) const;
+	int InitBuffers();
+	void StopPresent();
+	void PresentRoutine();
+	int Present(bool keep);
+	int WriteSpans();
+	void CopySpans(char *dst, Color const *src,
+		       std::vector<Rect> const &rects) const;
 };
 
 inline Fbuffer::Color *Fbuffer::operator[](std::uint32_t y)
 {
-	return buf + y * xres;
+	return buf + y * stride;
 }
 
 inline Fbuffer::Color const *Fbuffer::operator[](std::uint32_t y) const
 {
-	return buf + y * xres;
+	return buf + y * stride;
 }
 
 inline void Fbuffer::Fill(Fbuffer::Color c)
 {
-	for (std::size_t i = 0; i < xres * yres; ++i)
+	for (std::size_t i = 0; i < stride * yres; ++i)
 		buf[i] = c;
 }
 
 inline void Fbuffer::Clear()
 {
 	Color empty{ 0, 0, 0, 0 };
-	for (std::size_t i = 0; i < xres * yres; ++i)
+	for (std::size_t i = 0; i < stride * yres; ++i)
 		buf[i] = empty;
 }
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <include/wfobj.h>
+
+#include <cstdint>
+
+/* Average post-transform cache miss ratio, misses per triangle for a
+ * FIFO cache of cache_size vertices */
+float MeshAcmr(Wfobj::Mesh const &mesh, uint32_t cache_size);
+
+/* Shaded fragments per covered pixel with depth test and backface
+ * culling, averaged over the six axis views at res x res */
+float MeshOverdraw(Wfobj::Mesh const &mesh, uint32_t res = 256);
+
+/* Reorders triangles for the vertex cache (Tipsify), sorts the resulting
+ * clusters by a coarse Morton cell of their centroids for bin locality
+ * and outer-facing first within a cell to cut overdraw, then renumbers
+ * vertices in first-use order */
+void MeshOptimize(Wfobj::Mesh &mesh, uint32_t cache_size);
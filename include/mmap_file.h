@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+/* Read-only mapping of a whole file */
+struct MmapFile {
+	char const *data = nullptr;
+	std::size_t size = 0;
+
+	MmapFile() = default;
+	MmapFile(MmapFile const &) = delete;
+	MmapFile &operator=(MmapFile const &) = delete;
+
+	int Map(char const *path);
+	void Unmap();
+
+	~MmapFile()
+	{
+		Unmap();
+	}
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+/* Remove all timing instrumentation */
+//#define NO_PERF_STATS
+/* LLC misses per worker from a hardware counter, costs two syscalls
+ * per task batch, needs PERF_STATS */
+//#define PERF_LLC
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+#ifdef PERF_LLC
+extern "C" {
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+#endif
+
+#ifndef NO_PERF_STATS
+#define PERF_STATS
+#endif
+
+inline uint64_t PerfClockNs()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(
+		steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef PERF_LLC
+/* Counter of the calling thread, closed when it exits */
+struct PerfLlcCounter {
+	int fd;
+
+	PerfLlcCounter()
+	{
+		perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	~PerfLlcCounter()
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+};
+
+/* Last level cache misses of the calling thread so far, -1 when the
+ * kernel or CPU gives no hardware counters */
+inline int64_t PerfLlcMisses()
+{
+	thread_local PerfLlcCounter const counter;
+	uint64_t n;
+	if (counter.fd < 0 ||
+	    read(counter.fd, &n, sizeof(n)) != sizeof(n))
+		return -1;
+	return n;
+}
+#endif
+
+/* Written only by owning worker, padded against false sharing */
+struct alignas(64) PerfThreadStat {
+	uint64_t start_ns   = 0;	/* from run() to the first task */
+	uint64_t busy_ns    = 0;	/* executing tasks */
+	uint64_t barrier_ns = 0;	/* waiting for other workers */
+	uint64_t n_tasks    = 0;
+	uint64_t arrive_ns  = 0;	/* tmp: barrier arrival timestamp */
+	int64_t  llc_misses = -1;	/* while executing, -1 -> no PERF_LLC */
+};
+
+struct PerfStageStat {
+	struct Thread {
+		uint64_t start_ns   = 0;
+		uint64_t busy_ns    = 0;
+		uint64_t barrier_ns = 0;
+		uint64_t idle_ns    = 0;	/* wall - start - busy - barrier */
+		uint64_t n_tasks    = 0;
+		uint64_t llc_misses = 0;
+	};
+	bool has_llc = false;
+	uint64_t wall_ns = 0;
+	uint64_t n_runs  = 0;
+	std::vector<Thread> threads;
+
+	void Add(uint64_t wall, std::vector<PerfThreadStat> const &thr)
+	{
+		wall_ns += wall;
+		++n_runs;
+		threads.resize(thr.size());
+		for (std::size_t i = 0; i < thr.size(); ++i) {
+			auto &t = threads[i];
+			uint64_t used = thr[i].start_ns + thr[i].busy_ns +
+					thr[i].barrier_ns;
+			t.start_ns   += thr[i].start_ns;
+			t.busy_ns    += thr[i].busy_ns;
+			t.barrier_ns += thr[i].barrier_ns;
+			t.idle_ns    += wall > used ? wall - used : 0;
+			t.n_tasks    += thr[i].n_tasks;
+			if (thr[i].llc_misses >= 0) {
+				t.llc_misses += thr[i].llc_misses;
+				has_llc = true;
+			}
+		}
+	}
+
+	void Reset()
+	{
+		wall_ns = 0;
+		n_runs  = 0;
+		has_llc = false;
+		threads.clear();
+	}
+};
+
+inline std::ostream &operator<<(std::ostream &os, PerfStageStat const &st)
+{
+	double const ms = 1e-6;
+	uint64_t runs = st.n_runs ? st.n_runs : 1;
+	os << std::fixed << std::setprecision(3)
+	   << "wall " << st.wall_ns * ms / runs << " ms/run, "
+	   << st.n_runs << " runs" << std::endl;
+	for (std::size_t i = 0; i < st.threads.size(); ++i) {
+		auto const &t = st.threads[i];
+		os << "  thread[" << i << "]"
+		   << " start "   << t.start_ns   * ms / runs
+		   << " busy "    << t.busy_ns    * ms / runs
+		   << " barrier " << t.barrier_ns * ms / runs
+		   << " idle "    << t.idle_ns    * ms / runs
+		   << " tasks "   << t.n_tasks    / runs;
+		if (st.has_llc)
+			os << " llc_miss " << t.llc_misses / runs;
+		os << std::endl;
+	}
+	os << std::defaultfloat;
+	return os;
+}
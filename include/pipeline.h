@@ -3,15 +3,43 @@
 //#define HACK_DRAWBIN_NO_DRAWBACK
 
 #include <include/tile.h>
+#include <include/depth_target.h>
 #include <include/fbuffer.h>
 #include <include/geom.h>
 #include <include/sync_threadpool.h>
 #include <include/ppm.h>
+#include <include/perf_stats.h>
+#include <include/simd.h>
 
 #include <iostream>
 #include <vector>
 #include <array>
+#include <atomic>
+#include <algorithm>
 #include <typeinfo>
+#include <cassert>
+#include <cstring>
+
+#ifdef SIMD_PACK
+using PackMask = SimdPack::Mask;
+int constexpr PackWidth = SimdPack::width;
+
+/* PackWidth values shaded together, specialized for SoA layout */
+template <typename T>
+struct Pack {
+	T lane[PackWidth];
+
+	T get(int i) const
+	{
+		return lane[i];
+	}
+
+	void set(int i, T const &v)
+	{
+		lane[i] = v;
+	}
+};
+#endif
 
 template <typename _vs_in, typename _fs_in, typename _fs_out>
 struct Shader {
@@ -26,6 +54,30 @@ struct Shader {
 	virtual FsOut FShader(FsIn const &) const = 0;
 	virtual void set_view(Mat4 const &view, float scale) = 0;
 	virtual void set_window(Window const &) = 0;
+#ifdef SIMD_PACK
+	/* Shades lanes in mask of in[0..PackWidth) into out */
+	virtual void VShaderPack(VsIn const *in, PackMask mask,
+			VsOut *out) const
+	{
+		for (; mask; mask &= mask - 1) {
+			int i = __builtin_ctz(mask);
+			out[i] = VShader(in[i]);
+		}
+	}
+
+	using FsInPack = Pack<FsIn>;
+	/* FShaderPack reads the screen space derivatives of FsInPack */
+	bool fs_derivs = false;
+	/* Shades lanes in mask into out[0..PackWidth) */
+	virtual void FShaderPack(FsInPack const &in, PackMask mask,
+			FsOut *out) const
+	{
+		for (; mask; mask &= mask - 1) {
+			int i = __builtin_ctz(mask);
+			out[i] = FShader(in.get(i));
+		}
+	}
+#endif
 };
 
 template <typename _in, typename _data, typename _shader>
@@ -37,7 +89,16 @@ struct Setup
 
 	_Shader shader; // set it manually
 
-	virtual void Process(In const &, std::vector<Data> &) const = 0;
+	/* Upper bound of Data produced from one In */
+	static constexpr uint32_t max_out = 1;
+
+	using VsOut = typename _Shader::VsOut;
+
+	/* Writes up to max_out elements, returns their number */
+	virtual uint32_t Process(In const &, Data *) const = 0;
+	/* Same from shaded vertices vtx[ind[0..2]] */
+	virtual uint32_t ProcessShaded(VsOut const *vtx, uint32_t const *ind,
+			Data *) const = 0;
 	virtual void set_window(Window const &) = 0;
 };
 
@@ -50,14 +111,36 @@ struct BinRast {
 	virtual void set_window(Window const &) = 0;
 };
 
-template <typename _data, typename _in, typename _out>
+struct CoarseRastNoState {
+};
+
+/* State is per thread and lives over one bin, reset by ClearState */
+template <typename _data, typename _in, typename _out,
+	  typename _state = CoarseRastNoState>
 struct CoarseRast {
-	using Data = _data;
-	using In  = _in;
-	using Out = _out;
+	using Data  = _data;
+	using In    = _in;
+	using Out   = _out;
+	using State = _state;
+	/* Culls against depth the fine rasterizer writes */
+	static constexpr bool reads_depth = false;
 	virtual void Process(std::vector<Data> const &, In,
-			Bin<std::vector<Out>> &, Vec2i const &) const = 0;
+			Bin<std::vector<Out>> &, State &,
+			Vec2i const &) const = 0;
 	virtual void set_window(Window const &) = 0;
+	/* Only tiles [tile_beg, tile_end) of the bin are drawn, depth is
+	 * nullptr if pipeline has no depth target */
+	virtual void ClearState(State &, Vec2i const &, uint32_t tile_beg,
+			uint32_t tile_end, DepthTarget const *depth) const
+	{
+		/* Nothing */
+	}
+};
+
+template <typename _fragm>
+struct FineOut {
+	_fragm fragm;
+	uint32_t data_id;
 };
 
 template <typename _data, typename _in, typename _fragm>
@@ -65,15 +148,17 @@ struct FineRast {
 	using Data  = _data;
 	using In    = _in;
 	using Fragm = _fragm;
-	struct Out {
-		Fragm fragm;
-		uint32_t data_id;
-	};
+	using Out   = FineOut<Fragm>;
+	static constexpr bool writes_depth = false;
 	virtual bool Process(std::vector<Data> const &, In,
 			Tile<Out> &, Vec2i const &) const = 0;
 	virtual void set_window(Window const &) = 0;
-	virtual void ClearBuf(Tile<Out> &) const = 0;
-	virtual bool Check(Fragm const &fragm) const = 0;
+	/* Starts tile with depth of earlier draws, nullptr -> empty */
+	virtual void ClearBuf(Tile<Out> &, float const *depth) const = 0;
+	/* Writes depth of tile back, returns the farthest one */
+	virtual float StoreDepth(Tile<Out> const &, float *depth) const = 0;
+	/* Fragment was written by this pipeline */
+	virtual bool Check(Out const &out) const = 0;
 };
 
 template <typename _data, typename _fragm, typename _out>
@@ -82,8 +167,50 @@ struct Interp {
 	using Fragm = _fragm;
 	using Out   = _out;
 	virtual Out Process(Data const &, Fragm const &) const = 0;
+#ifdef SIMD_PACK
+	using OutPack = Pack<Out>;
+	/* ProcessPack fills derivatives of out too, set by Render from
+	 * Shader::fs_derivs */
+	bool derivs = false;
+	/* Lanes in mask of fragm[0..PackWidth), one tile row chunk */
+	virtual void ProcessPack(std::vector<Data> const &data_buf,
+		FineOut<Fragm> const *fragm, PackMask mask,
+		OutPack &out) const
+	{
+		for (; mask; mask &= mask - 1) {
+			int i = __builtin_ctz(mask);
+			out.set(i, Process(data_buf[fragm[i].data_id],
+					   fragm[i].fragm));
+		}
+	}
+#endif
 };
 
+enum class PipelineStage {
+	VERTEX_SHADE,
+	SETUP_PROCESS,
+	BIN_RAST,
+	DRAW_BIN,
+	N_STAGES,
+};
+
+enum class PipelineResolveType {
+	DIRECT,	/* shaders write the color buffer in place */
+	STREAM,	/* tiles written whole are shaded into a thread local tile,
+		 * then stored with non-temporal stores past the caches */
+};
+
+inline char const *PipelineStageName(PipelineStage stage)
+{
+	static char const *names[] = {
+		"VertexShadeRoutine",
+		"SetupProcessRoutine",
+		"BinRastRoutine",
+		"DrawBinRoutine",
+	};
+	return names[int(stage)];
+}
+
 template <typename _shader,      template <typename> class _setup,
 	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
 	  typename _interp>
@@ -92,17 +219,75 @@ struct Pipeline {
 	using _Setup   = _setup<_Shader>;
 	using Input    = typename _Setup::In;
 	using InputBuf = std::vector<Input>;
+	using VertexBuf = std::vector<typename _Shader::VsIn>;
+	using IndexBuf  = std::vector<uint32_t>;
 
 	_Shader shader;
 
 	void Accumulate(InputBuf const &_inp_buf);
-	void Render(Fbuffer::Color *cbuf);
+	/* Indexed mesh, every vertex is shaded once per call */
+	void Accumulate(VertexBuf const &verts, IndexBuf const &inds);
+	/* stride in pixels, 0 -> window width */
+	void Render(Fbuffer::Color *cbuf, uint32_t stride = 0);
 	void set_window(Window const &wnd);
 	void set_sync_tp(SyncThreadpool *sync_tp_);
+	/* Shared by pipelines drawing one frame, nullptr -> private depth.
+	 * Requires depth testing fine rast, cleared by owner per frame.
+	 * Only the first of these pipelines may set_clear_color */
+	void set_depth_target(DepthTarget *depth_)
+	{
+		depth = depth_;
+	}
+	/* Tiles drawn by Render are marked in dirty, nullptr -> none.
+	 * Reset by Fbuffer::Update(FbDirtyTiles &) */
+	void set_dirty_target(FbDirtyTiles *dirty_)
+	{
+		assert(!dirty_ || dirty_->tile_size == TILE_SIZE);
+		dirty = dirty_;
+	}
+	/* Render writes c to window pixels no fragment covers, while their
+	 * tile is hot, in place of a full frame clear. For the first
+	 * pipeline of a frame only, it overwrites what others drew. Pipelines
+	 * sharing a DepthTarget are no exception, a later one would clear
+	 * pixels the earlier ones drew in its tiles */
+	void set_clear_color(Fbuffer::Color c)
+	{
+		clear = true;
+		clear_color = c;
+	}
+	/* Render leaves uncovered pixels alone again, for overlay passes */
+	void disable_clear()
+	{
+		clear = false;
+	}
+	/* STREAM needs SIMD_PACK and a color buffer and stride aligned to
+	 * the pack, otherwise Render falls back to DIRECT */
+	void set_resolve(PipelineResolveType resolve_)
+	{
+		resolve = resolve_;
+	}
+#ifdef PERF_STATS
+	PerfStageStat const &get_stats(PipelineStage stage) const
+	{
+		return stats[int(stage)];
+	}
+	void reset_stats()
+	{
+		for (auto &st : stats)
+			st.Reset();
+	}
+	void print_stats(std::ostream &os) const
+	{
+		for (int i = 0; i < int(PipelineStage::N_STAGES); ++i)
+			os << PipelineStageName(PipelineStage(i)) << ": "
+			   << stats[i];
+	}
+#endif
 private:
 	uint32_t w_bins = 0;
 	uint32_t h_bins = 0;
 	uint32_t w_pix  = 0;
+	uint32_t h_pix  = 0;
 
 	using    _BinRast =    _bin_rast;
 	using _CoarseRast = _coarse_rast;
@@ -115,6 +300,9 @@ private:
 	_FineRast     fine_rast;
 	_Interp          interp;
 
+	static_assert(!_CoarseRast::reads_depth || _FineRast::writes_depth,
+		      "coarse rast culls against depth nobody writes");
+
 	using Data      = typename _Setup::Data;
 	using BinOut    = typename _BinRast::Out;
 	using CoarseOut = typename _CoarseRast::Out;
@@ -123,11 +311,13 @@ private:
 	using DataBuf   = std::vector<Data>;
 	using BinBuf    = std::vector<std::vector<BinOut>>;
 	using CoarseBuf = Bin<std::vector<CoarseOut>>;
+	using CoarseState = typename _CoarseRast::State;
 	using FineBuf   = Tile<Fragm>;
 
-	std::vector<DataBuf>     data_buffs;
+	DataBuf                    data_buf;
 	std::vector<BinBuf>       bin_buffs;
 	std::vector<CoarseBuf> coarse_buffs;
+	std::vector<CoarseState> coarse_states;
 	std::vector<FineBuf>     fine_buffs;
 
 	/* Threading & routines */
@@ -139,13 +329,85 @@ private:
 	};
 	std::vector<Task> task_buf;
 
+	/* Setup task i owns data_buf slots from its input range times
+	 * max_out, valid ids are data_ranges[i], ordered as input */
+	uint32_t              data_size = 0;
+	std::vector<Task>     data_ranges;
+	std::vector<uint32_t> setup_counts;
+
+	/* Draw stage: bin or part of its tile rows, weighted by bin queues */
+	struct DrawTask {
+		uint32_t bin_id;
+		uint32_t tile_beg;
+		uint32_t tile_end;
+		uint32_t cost;
+	};
+	/* Range of draw_order owned by thread, head << 32 | tail */
+	struct alignas(64) DrawQueue {
+		std::atomic<uint64_t> range;
+	};
+	std::vector<DrawTask>  draw_tasks;
+	std::vector<uint32_t>  draw_order;
+	std::vector<DrawQueue> draw_queues;
+	std::vector<std::vector<uint32_t>> merge_pos;
+
+	DepthTarget *depth = nullptr;
+	FbDirtyTiles *dirty = nullptr;
+	bool clear = false;
+	Fbuffer::Color clear_color = {};
+	PipelineResolveType resolve = PipelineResolveType::DIRECT;
+	bool stream = false;
+
+	struct alignas(64) ColorTile {
+		Tile<Fbuffer::Color> px;
+	};
+	std::vector<ColorTile> color_tiles;
+
 	InputBuf const *cur_inp_buf;
+	VertexBuf const *cur_vtx_buf;
+	IndexBuf const *cur_ind_buf;
+	std::vector<typename _Shader::VsOut> vtx_out_buf;
 	Fbuffer::Color *cur_cbuf;
+	uint32_t cur_stride;
+
+#ifdef PERF_STATS
+	PerfStageStat stats[int(PipelineStage::N_STAGES)];
+#endif
 
+	void  VertexShadeRoutine(int thread_id, int task_id);
 	void SetupProcessRoutine(int thread_id, int task_id);
-	void   SetupMergeRoutine(int thread_id, int task_id);
+	void SetupShadedRoutine(int thread_id, int task_id);
 	void      BinRastRoutine(int thread_id, int task_id);
 	void      DrawBinRoutine(int thread_id, int task_id);
+
+	uint32_t SetupBegin(uint32_t n_prims);
+	void SetupEnd(uint32_t range_offs, uint32_t n_prims);
+	void ScheduleDrawTasks();
+	bool DrawQueuePop(uint32_t queue_id, bool steal, uint32_t &draw_id);
+	void DrawBin(int thread_id, DrawTask const &task);
+	void ClearTile(Fbuffer::Color *cbuf, Vec2i const &r0) const;
+#ifdef SIMD_PACK
+	bool TileInWindow(Vec2i const &r0) const
+	{
+		return r0.x + TILE_SIZE <= w_pix && r0.y + TILE_SIZE <= h_pix;
+	}
+	void StreamTile(Fbuffer::Color *out, Fbuffer::Color const *tile) const
+	{
+		for (int32_t y = 0; y < TILE_SIZE; ++y)
+			for (int32_t x = 0; x < TILE_SIZE; x += PackWidth)
+				SimdPack::streami(&out[x + y * cur_stride],
+					SimdPack::loadi(&tile[x + y * TILE_SIZE]));
+	}
+	/* Lanes of the pack at r inside the window */
+	PackMask ClipMask(Vec2i const &r) const
+	{
+		if (uint32_t(r.y) >= h_pix || uint32_t(r.x) >= w_pix)
+			return 0;
+		if (r.x + PackWidth <= w_pix)
+			return SimdPack::full;
+		return (PackMask(1) << (w_pix - r.x)) - 1;
+	}
+#endif
 };
 
 template <typename _shader,      template<typename> class _setup,
@@ -161,6 +423,7 @@ void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
 	  fine_rast.set_window(wnd);
 
 	w_pix  = wnd.w;
+	h_pix  = wnd.h;
 	w_bins = DivRoundUp(w_pix, BIN_SIZE * TILE_SIZE);
 	h_bins = DivRoundUp(wnd.h, BIN_SIZE * TILE_SIZE);
 
@@ -177,28 +440,45 @@ void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
 	sync_tp = sync_tp_;
 	uint32_t n_threads = sync_tp->get_concurrency();
 
-	  data_buffs.resize(n_threads);
 	   bin_buffs.resize(n_threads);
 	coarse_buffs.resize(n_threads);
+	coarse_states.resize(n_threads);
 	  fine_buffs.resize(n_threads);
+	 color_tiles.resize(n_threads);
 
 	for (auto &buf : bin_buffs)
 		buf.resize(w_bins * h_bins);
+
+	draw_queues = std::vector<DrawQueue>(n_threads);
+	merge_pos.assign(n_threads, std::vector<uint32_t>(n_threads));
 }
 
-#define pipeline_execute_tasks(_routine)				\
+#ifdef PERF_STATS
+#define pipeline_stats_begin()						\
+	uint64_t stats_t0 = PerfClockNs()
+#define pipeline_stats_end(_stage)					\
+	stats[int(PipelineStage::_stage)].Add(PerfClockNs() - stats_t0,	\
+		sync_tp->get_stats())
+#else
+#define pipeline_stats_begin()		do { } while (0)
+#define pipeline_stats_end(_stage)	do { } while (0)
+#endif
+
+#define pipeline_execute_tasks(_routine, _stage)			\
 do {									\
 	sync_tp->set_tasks(std::bind(&Pipeline::_routine, this,		\
 		std::placeholders::_1, std::placeholders::_2),		\
 			task_buf.size());				\
+	pipeline_stats_begin();						\
 	sync_tp->run();							\
 	sync_tp->wait_completion();					\
+	pipeline_stats_end(_stage);					\
 	task_buf.clear();						\
 } while (0)
 
-#define pipeline_split_tasks(_buffer, _task_size)			\
+#define pipeline_split_tasks(_size, _task_size)				\
 do {									\
-	uint32_t total_size = _buffer.size(), task_size = _task_size;	\
+	uint32_t total_size = _size, task_size = _task_size;		\
 	for (uint32_t offs = 0; offs < total_size; offs += task_size) {	\
 		Task task;						\
 		task.beg = offs;					\
@@ -210,19 +490,6 @@ do {									\
 	}								\
 } while (0)
 
-/* Bad way to merge, unstable & n-1 threads usage */
-#define pipeline_merge_tasks(_buffers)					\
-do {									\
-	uint32_t offs = 0;						\
-	for (uint32_t i = 0; i < _buffers.size(); ++i) {		\
-		Task task = {.beg = i, .end = offs };			\
-		offs += _buffers[i].size();				\
-		if (i != 0)						\
-			task_buf.push_back(task);			\
-	}								\
-	_buffers[0].resize(offs);					\
-} while (0)
-
 template <typename _shader,      template<typename> class _setup,
 	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
 	   typename _interp>
@@ -230,25 +497,51 @@ void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
       _interp>::SetupProcessRoutine(int thread_id, int task_id)
 {
 	auto task = task_buf[task_id];
-	auto &data_buf = data_buffs[thread_id];
 	auto const &inp_buf = *cur_inp_buf;
+	Data *out = &data_buf[data_size + task.beg * _Setup::max_out];
+
+	uint32_t count = 0;
+	for (uint32_t i = task.beg; i < task.end; ++i)
+		count += setup.Process(inp_buf[i], out + count);
+	setup_counts[task_id] = count;
+}
 
+template <typename _shader,      template<typename> class _setup,
+	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
+	   typename _interp>
+void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
+      _interp>::VertexShadeRoutine(int thread_id, int task_id)
+{
+	auto task = task_buf[task_id];
+	auto const &vtx_buf = *cur_vtx_buf;
+
+#ifdef SIMD_PACK
+	for (uint32_t i = task.beg; i < task.end; i += PackWidth) {
+		uint32_t n = std::min<uint32_t>(PackWidth, task.end - i);
+		PackMask mask = SimdPack::full >> (PackWidth - n);
+		setup.shader.VShaderPack(&vtx_buf[i], mask, &vtx_out_buf[i]);
+	}
+#else
 	for (uint32_t i = task.beg; i < task.end; ++i)
-		setup.Process(inp_buf[i], data_buf);
+		vtx_out_buf[i] = setup.shader.VShader(vtx_buf[i]);
+#endif
 }
 
 template <typename _shader,      template<typename> class _setup,
 	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
 	   typename _interp>
 void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
-      _interp>::SetupMergeRoutine(int thread_id, int task_id)
+      _interp>::SetupShadedRoutine(int thread_id, int task_id)
 {
 	auto task = task_buf[task_id];
-	auto &my_buf = data_buffs[task.beg];
-	auto &target_buf = data_buffs[0];
+	uint32_t const *inds = cur_ind_buf->data();
+	Data *out = &data_buf[data_size + task.beg * _Setup::max_out];
 
-	for (uint32_t offs = 0; offs < my_buf.size(); ++offs)
-		target_buf[offs + task.end] = my_buf[offs];
+	uint32_t count = 0;
+	for (uint32_t i = task.beg; i < task.end; ++i)
+		count += setup.ProcessShaded(vtx_out_buf.data(), &inds[3 * i],
+					     out + count);
+	setup_counts[task_id] = count;
 }
 
 template <typename _shader,      template<typename> class _setup,
@@ -257,8 +550,9 @@ template <typename _shader,      template<typename> class _setup,
 void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
       _interp>::BinRastRoutine(int thread_id, int task_id)
 {
-	auto task = task_buf[task_id];
-	auto &data_buf = data_buffs[0];
+	/* Pool hands out ids in descending order, flip it so that every
+	 * thread fills its bin queues with ascending data ids */
+	auto task = task_buf[task_buf.size() - 1 - task_id];
 	auto &bin_buf = bin_buffs[thread_id];
 
 	for (uint32_t i = task.beg; i < task.end; ++i)
@@ -269,53 +563,149 @@ template <typename _shader,      template<typename> class _setup,
 	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
 	   typename _interp>
 void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
-      _interp>::DrawBinRoutine(int thread_id, int task_id)
+      _interp>::DrawBin(int thread_id, DrawTask const &task)
 {
-	auto task = task_buf[task_id];
-	uint32_t bin_id = task.beg;
+	uint32_t bin_id = task.bin_id;
 
 	auto *cbuf = cur_cbuf;
-	auto &data_buf = data_buffs[0];
 	auto &coarse_buf = coarse_buffs[thread_id];
+	auto &coarse_state = coarse_states[thread_id];
 	auto   &fine_buf =   fine_buffs[thread_id];
 
 	Vec2i bin_coord; // in bins
 	bin_coord.x = bin_id % w_bins;
 	bin_coord.y = (bin_id - bin_coord.x) / w_bins;
-
-	uint32_t bin_count = 0;
-	for (auto const &bin_buf : bin_buffs) {
-		for (auto const &out : bin_buf[bin_id]) {
-			coarse_rast.Process(data_buf, out,
-					coarse_buf, bin_coord);
-			++bin_count;
+	coarse_rast.ClearState(coarse_state, bin_coord, task.tile_beg,
+			task.tile_end, depth);
+
+	/* Thread queues are sorted by id, merge them to keep submission
+	 * order: take the smallest head and drain it up to the next one */
+	uint32_t n_queues = bin_buffs.size();
+	auto &pos = merge_pos[thread_id];
+	std::fill(pos.begin(), pos.end(), 0);
+	while (true) {
+		uint32_t q_min = n_queues;
+		uint32_t id_min = UINT32_MAX, id_next = UINT32_MAX;
+		for (uint32_t q = 0; q < n_queues; ++q) {
+			auto const &queue = bin_buffs[q][bin_id];
+			if (pos[q] == queue.size())
+				continue;
+			uint32_t id = queue[pos[q]].id;
+			if (id < id_min) {
+				id_next = id_min;
+				id_min = id;
+				q_min = q;
+			} else if (id < id_next) {
+				id_next = id;
+			}
 		}
+		if (q_min == n_queues)
+			break;
+
+		auto const &queue = bin_buffs[q_min][bin_id];
+		uint32_t &i = pos[q_min];
+		do {
+			coarse_rast.Process(data_buf, queue[i],
+					coarse_buf, coarse_state, bin_coord);
+		} while (++i < queue.size() && queue[i].id < id_next);
 	}
-	if (bin_count == 0)
-		return;
 
 	_Shader loc_shader = shader;
 
-	for (uint32_t tile_id = 0; tile_id < coarse_buf.size(); ++tile_id) {
-		if (coarse_buf[tile_id].size() == 0)
-			continue;
-		fine_rast.ClearBuf(fine_buf);
-
+	for (uint32_t tile_id = task.tile_beg; tile_id < task.tile_end;
+			++tile_id) {
 		Vec2i tile_coord; // in tiles
 		tile_coord.x = bin_coord.x * BIN_SIZE;
 		tile_coord.y = bin_coord.y * BIN_SIZE;
 		tile_coord.x += tile_id % BIN_SIZE;
 		tile_coord.y += (tile_id - tile_id % BIN_SIZE) / BIN_SIZE;
 
+		Vec2i r0 = {.x = tile_coord.x * TILE_SIZE,
+			    .y = tile_coord.y * TILE_SIZE };
+
+		if (coarse_buf[tile_id].size() == 0) {
+			if (!clear)
+				continue;
+			ClearTile(cbuf, r0);
+			if (dirty)
+				dirty->Mark(tile_coord.x, tile_coord.y);
+			continue;
+		}
+
+		uint32_t depth_id = 0;
+		float const *depth_in = nullptr;
+		if (depth) {
+			depth_id = depth->get_tile_id(tile_coord);
+			depth_in = depth->Load(depth_id);
+		}
+		fine_rast.ClearBuf(fine_buf, depth_in);
+
 		bool full = false;
 		for (auto const &out : coarse_buf[tile_id]) {
 			full |= fine_rast.Process(data_buf, out, fine_buf,
 					tile_coord);
 		}
-
-		Vec2i r0 = {.x = tile_coord.x * TILE_SIZE,
-			    .y = tile_coord.y * TILE_SIZE };
-
+		/* Earlier draws may win depth test over accepted ones */
+		if (depth_in)
+			full = false;
+		if (depth) {
+			float min = fine_rast.StoreDepth(fine_buf,
+					depth->get_tile(depth_id));
+			depth->Commit(depth_id, min);
+		}
+		if (dirty)
+			dirty->Mark(tile_coord.x, tile_coord.y);
+
+#ifdef SIMD_PACK
+		static_assert(TILE_SIZE % PackWidth == 0);
+		int32_t clear_word;
+		memcpy(&clear_word, &clear_color, sizeof(clear_word));
+		SimdPack::I const clear_pack = SimdPack::seti(clear_word);
+		/* Streamed tiles must be written whole, the local tile holds
+		 * no earlier frame contents */
+		bool const stream_tile = stream && (full || clear) &&
+					 TileInWindow(r0);
+		Fbuffer::Color *dst = &cbuf[r0.x + r0.y * cur_stride];
+		uint32_t dst_stride = cur_stride;
+		if (stream_tile) {
+			dst = color_tiles[thread_id].px.data();
+			dst_stride = TILE_SIZE;
+		}
+		for (int32_t y = 0; y < TILE_SIZE; ++y) {
+			for (int32_t x = 0; x < TILE_SIZE; x += PackWidth) {
+				auto const *fine_row =
+					&fine_buf[x + TILE_SIZE * y];
+				Vec2i r = {.x = r0.x + x, .y = r0.y + y};
+				uint32_t dst_ind = x + y * dst_stride;
+				PackMask mask = SimdPack::full;
+				if (!full) {
+					mask = 0;
+					for (int i = 0; i < PackWidth; ++i) {
+						if (fine_rast.Check(
+							fine_row[i]))
+							mask |= PackMask(1) << i;
+					}
+					if (clear && mask != SimdPack::full)
+						SimdPack::storei(&dst[dst_ind],
+							clear_pack, PackMask(
+							~mask & ClipMask(r)));
+					if (!mask)
+						continue;
+				}
+				typename _Interp::OutPack inp_out;
+				interp.ProcessPack(data_buf, fine_row, mask,
+						   inp_out);
+#ifndef HACK_DRAWBIN_NO_DRAWBACK
+				loc_shader.FShaderPack(inp_out, mask,
+						       &dst[dst_ind]);
+#else
+				loc_shader.FShaderPack(inp_out, mask, cbuf);
+#endif
+			}
+		}
+		if (stream_tile)
+			StreamTile(&cbuf[r0.x + r0.y * cur_stride], dst);
+#else
 		if (full)
 			goto shade_full;
 		else
@@ -330,7 +720,7 @@ shade_full:
 
 				auto inp_out = interp.Process(data, fragm);
 				Vec2i r = {.x = r0.x + x, .y = r0.y + y};
-				uint32_t cbuf_ind = r.x + r.y * w_pix;
+				uint32_t cbuf_ind = r.x + r.y * cur_stride;
 #ifndef HACK_DRAWBIN_NO_DRAWBACK
 				cbuf[cbuf_ind] = loc_shader.FShader(inp_out);
 #else
@@ -346,13 +736,17 @@ shade_default:
 				uint32_t fragm_ind = x + TILE_SIZE * y;
 				auto const &fine_out = fine_buf[fragm_ind];
 				auto const &fragm = fine_out.fragm;
-				if (fine_rast.Check(fragm) == false)
+				Vec2i r = {.x = r0.x + x, .y = r0.y + y};
+				uint32_t cbuf_ind = r.x + r.y * cur_stride;
+				if (fine_rast.Check(fine_out) == false) {
+					if (clear && uint32_t(r.x) < w_pix &&
+					    uint32_t(r.y) < h_pix)
+						cbuf[cbuf_ind] = clear_color;
 					continue;
+				}
 
 				auto const &data = data_buf[fine_out.data_id];
 				auto inp_out = interp.Process(data, fragm);
-				Vec2i r = {.x = r0.x + x, .y = r0.y + y};
-				uint32_t cbuf_ind = r.x + r.y * w_pix;
 #ifndef HACK_DRAWBIN_NO_DRAWBACK
 				cbuf[cbuf_ind] = loc_shader.FShader(inp_out);
 #else
@@ -360,11 +754,191 @@ shade_default:
 #endif
 			}
 		}
+#endif
 	}
 	for (auto &tile : coarse_buf)
 		tile.clear();
 }
 
+/* Window part of the tile at r0 to clear_color */
+template <typename _shader,      template<typename> class _setup,
+	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
+	   typename _interp>
+void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
+      _interp>::ClearTile(Fbuffer::Color *cbuf, Vec2i const &r0) const
+{
+#ifdef SIMD_PACK
+	if (stream && TileInWindow(r0)) {
+		int32_t c;
+		memcpy(&c, &clear_color, sizeof(c));
+		SimdPack::I clear_pack = SimdPack::seti(c);
+		for (int32_t y = 0; y < TILE_SIZE; ++y)
+			for (int32_t x = 0; x < TILE_SIZE; x += PackWidth)
+				SimdPack::streami(&cbuf[r0.x + x +
+					(r0.y + y) * cur_stride], clear_pack);
+		return;
+	}
+#endif
+	int32_t w = std::min<int32_t>(TILE_SIZE, int32_t(w_pix) - r0.x);
+	int32_t h = std::min<int32_t>(TILE_SIZE, int32_t(h_pix) - r0.y);
+	for (int32_t y = 0; y < h; ++y)
+		std::fill_n(&cbuf[r0.x + (r0.y + y) * cur_stride], w,
+			    clear_color);
+}
+
+template <typename _shader,      template<typename> class _setup,
+	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
+	   typename _interp>
+bool Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
+      _interp>::DrawQueuePop(uint32_t queue_id, bool steal, uint32_t &draw_id)
+{
+	auto &range = draw_queues[queue_id].range;
+	uint64_t cur = range.load(std::memory_order_relaxed);
+	while (true) {
+		uint32_t head = cur >> 32;
+		uint32_t tail = cur & UINT32_MAX;
+		if (head >= tail)
+			return false;
+		/* Owner takes heaviest, thief takes lightest */
+		uint64_t next = steal ? (uint64_t(head) << 32) | (tail - 1)
+				      : (uint64_t(head + 1) << 32) | tail;
+		if (range.compare_exchange_weak(cur, next)) {
+			draw_id = draw_order[steal ? tail - 1 : head];
+			return true;
+		}
+	}
+}
+
+template <typename _shader,      template<typename> class _setup,
+	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
+	   typename _interp>
+void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
+      _interp>::DrawBinRoutine(int thread_id, int task_id)
+{
+	uint32_t n_queues = draw_queues.size();
+	uint32_t draw_id;
+
+	while (DrawQueuePop(thread_id, false, draw_id))
+		DrawBin(thread_id, draw_tasks[draw_id]);
+
+	for (uint32_t i = 1; i < n_queues; ++i) {
+		uint32_t victim = (thread_id + i) % n_queues;
+		while (DrawQueuePop(victim, true, draw_id))
+			DrawBin(thread_id, draw_tasks[draw_id]);
+	}
+	/* Streaming stores are weakly ordered, publish before the barrier */
+	if (stream)
+		_mm_sfence();
+}
+
+/* Longest bins first, dealt to threads in snake order, heavy bins are
+ * split in tile rows */
+template <typename _shader,      template<typename> class _setup,
+	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
+	   typename _interp>
+void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
+      _interp>::ScheduleDrawTasks()
+{
+	uint32_t n_bins = w_bins * h_bins;
+	uint32_t n_queues = draw_queues.size();
+	uint64_t total_cost = 0;
+
+	draw_tasks.clear();
+	for (uint32_t bin_id = 0; bin_id < n_bins; ++bin_id) {
+		uint32_t cost = 0;
+		for (auto const &bin_buf : bin_buffs)
+			cost += bin_buf[bin_id].size();
+		/* Empty bins are only drawn to be cleared */
+		if (cost == 0 && !clear)
+			continue;
+		total_cost += cost;
+		draw_tasks.push_back(DrawTask{ .bin_id = bin_id,
+			.tile_beg = 0, .tile_end = BIN_SIZE * BIN_SIZE,
+			.cost = cost });
+	}
+
+	/* Coarse rast is repeated for every part, so split only bins that
+	 * would otherwise dominate the frame tail */
+	uint64_t split_cost = total_cost / (4 * n_queues) + 1;
+	if (n_queues > 1) {
+		uint32_t n_tasks = draw_tasks.size();
+		for (uint32_t i = 0; i < n_tasks; ++i) {
+			DrawTask task = draw_tasks[i];
+			if (task.cost <= split_cost)
+				continue;
+			uint32_t n_parts = std::min<uint64_t>(BIN_SIZE,
+					DivRoundUp(task.cost, split_cost));
+			uint32_t rows = DivRoundUp(BIN_SIZE, n_parts);
+			n_parts = DivRoundUp(BIN_SIZE, rows);
+			task.cost /= n_parts;
+			for (uint32_t y = 0; y < BIN_SIZE; y += rows) {
+				task.tile_beg = y * BIN_SIZE;
+				task.tile_end = std::min(y + rows, uint32_t(BIN_SIZE))
+					      * BIN_SIZE;
+				if (y == 0)
+					draw_tasks[i] = task;
+				else
+					draw_tasks.push_back(task);
+			}
+		}
+	}
+
+	uint32_t n_tasks = draw_tasks.size();
+	std::vector<uint32_t> sorted(n_tasks);
+	for (uint32_t i = 0; i < n_tasks; ++i)
+		sorted[i] = i;
+	std::stable_sort(sorted.begin(), sorted.end(),
+		[this](uint32_t a, uint32_t b) {
+			return draw_tasks[a].cost > draw_tasks[b].cost;
+		});
+
+	draw_order.resize(n_tasks);
+	uint32_t offs = 0;
+	for (uint32_t q = 0; q < n_queues; ++q) {
+		uint32_t beg = offs;
+		for (uint32_t i = 0; i < n_tasks; i += 2 * n_queues) {
+			if (i + q < n_tasks)
+				draw_order[offs++] = sorted[i + q];
+			if (i + 2 * n_queues - 1 - q < n_tasks)
+				draw_order[offs++] =
+					sorted[i + 2 * n_queues - 1 - q];
+		}
+		draw_queues[q].range = (uint64_t(beg) << 32) | offs;
+	}
+}
+
+/* Reserves data_buf slots for setup tasks in task_buf */
+template <typename _shader,      template<typename> class _setup,
+	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
+	  typename _interp>
+uint32_t Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
+ _interp>::SetupBegin(uint32_t n_prims)
+{
+	uint32_t n_tasks = task_buf.size();
+	uint32_t range_offs = data_ranges.size();
+	for (auto const &task : task_buf) {
+		uint32_t beg = data_size + task.beg * _Setup::max_out;
+		data_ranges.push_back(Task{ .beg = beg, .end = beg });
+	}
+	setup_counts.resize(n_tasks);
+	/* Grow only, slots are overwritten by setup */
+	uint32_t new_size = data_size + n_prims * _Setup::max_out;
+	if (data_buf.size() < new_size)
+		data_buf.resize(new_size);
+	return range_offs;
+}
+
+template <typename _shader,      template<typename> class _setup,
+	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
+	  typename _interp>
+void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
+ _interp>::SetupEnd(uint32_t range_offs, uint32_t n_prims)
+{
+	for (uint32_t i = 0; i < setup_counts.size(); ++i)
+		data_ranges[range_offs + i].end += setup_counts[i];
+	data_size += n_prims * _Setup::max_out;
+}
+
 template <typename _shader,      template<typename> class _setup,
 	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
 	  typename _interp>
@@ -373,12 +947,34 @@ void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
 {
 	cur_inp_buf = &inp_buf;
 	setup.shader = shader;
+	uint32_t n_prims = inp_buf.size();
 
-	pipeline_split_tasks(inp_buf, 256); // big chunks for better coherency
-	pipeline_execute_tasks(SetupProcessRoutine);
+	pipeline_split_tasks(n_prims, 256); // big chunks for better coherency
+	uint32_t range_offs = SetupBegin(n_prims);
+	pipeline_execute_tasks(SetupProcessRoutine, SETUP_PROCESS);
+	SetupEnd(range_offs, n_prims);
+}
 
-	pipeline_merge_tasks(data_buffs);
-	pipeline_execute_tasks(SetupMergeRoutine);
+template <typename _shader,      template<typename> class _setup,
+	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
+	  typename _interp>
+void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
+ _interp>::Accumulate(VertexBuf const &verts, IndexBuf const &inds)
+{
+	cur_vtx_buf = &verts;
+	cur_ind_buf = &inds;
+	setup.shader = shader;
+	uint32_t n_prims = inds.size() / 3;
+
+	if (vtx_out_buf.size() < verts.size())
+		vtx_out_buf.resize(verts.size());
+	pipeline_split_tasks(verts.size(), 1024);
+	pipeline_execute_tasks(VertexShadeRoutine, VERTEX_SHADE);
+
+	pipeline_split_tasks(n_prims, 256);
+	uint32_t range_offs = SetupBegin(n_prims);
+	pipeline_execute_tasks(SetupShadedRoutine, SETUP_PROCESS);
+	SetupEnd(range_offs, n_prims);
 }
 
 
@@ -386,18 +982,34 @@ template <typename _shader,      template<typename> class _setup,
 	  typename _bin_rast,    typename _coarse_rast, typename _fine_rast,
 	  typename _interp>
 void Pipeline<_shader, _setup, _bin_rast, _coarse_rast, _fine_rast,
- _interp>::Render(Fbuffer::Color *cbuf)
+ _interp>::Render(Fbuffer::Color *cbuf, uint32_t stride)
 {
 	cur_cbuf = cbuf;
+	cur_stride = stride ? stride : w_pix;
+#ifdef SIMD_PACK
+	uint32_t const align = PackWidth * sizeof(Fbuffer::Color);
+	stream = resolve == PipelineResolveType::STREAM &&
+		 reinterpret_cast<uintptr_t>(cbuf) % align == 0 &&
+		 cur_stride * sizeof(Fbuffer::Color) % align == 0;
+	interp.derivs = shader.fs_derivs;
+#endif
 
-	pipeline_split_tasks(data_buffs[0], 32);
-	pipeline_execute_tasks(BinRastRoutine);
+	for (auto const &range : data_ranges) {
+		for (uint32_t beg = range.beg; beg < range.end; beg += 32) {
+			Task task = { .beg = beg,
+				      .end = std::min(beg + 32, range.end) };
+			task_buf.push_back(task);
+		}
+	}
+	pipeline_execute_tasks(BinRastRoutine, BIN_RAST);
 
-	pipeline_split_tasks(bin_buffs[0], 1);
-	pipeline_execute_tasks(DrawBinRoutine);
+	ScheduleDrawTasks();
+	for (uint32_t i = 0; i < draw_queues.size(); ++i)
+		task_buf.push_back(Task{ .beg = i, .end = i + 1 });
+	pipeline_execute_tasks(DrawBinRoutine, DRAW_BIN);
 
-	for (auto &buf : data_buffs)
-		buf.clear();
+	data_size = 0;
+	data_ranges.clear();
 
 	for (auto &buf : bin_buffs) {
 		for (auto &bin : buf)
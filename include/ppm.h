@@ -4,8 +4,9 @@
 #include <vector>
 
 struct PpmImg {
-	struct Color {
-		uint8_t r, g, b;
+	/* Same layout as Fbuffer::Color, a = 255 */
+	struct alignas(4) Color {
+		uint8_t b, g, r, a;
 	};
 
 	std::vector<Color> buf;
@@ -1,9 +1,73 @@
 #pragma once
 
 #include <include/pipeline.h>
+#include <include/texture.h>
 
 //#define HACK_TRSHADER_NO_BOUNDS
 
+#ifdef SIMD_PACK
+template <>
+struct Pack<Vertex> {
+	using F = SimdPack::F;
+	F pos[3];
+	F tex[2];
+	F norm[3];
+	/* Screen space derivatives of tex, set by interpolation */
+	F tex_dx[2];
+	F tex_dy[2];
+
+	Vertex get(int i) const
+	{
+		alignas(64) float tmp[8][PackWidth];
+		for (int k = 0; k < 8; ++k)
+			SimdPack::store(tmp[k], attr(k));
+		Vertex v;
+		v.pos  = Vec3 {tmp[0][i], tmp[1][i], tmp[2][i]};
+		v.tex  = Vec2 {tmp[3][i], tmp[4][i]};
+		v.norm = Vec3 {tmp[5][i], tmp[6][i], tmp[7][i]};
+		return v;
+	}
+
+	/* Lanes in mask from v[0..PackWidth), 0 otherwise */
+	static Pack Load(Vertex const *v, PackMask mask)
+	{
+		using S = SimdPack;
+		float const *base = &v->pos.x;
+		S::I offs = S::muli(S::lanesi(),
+				    S::seti(sizeof(Vertex) / sizeof(float)));
+		Pack pack;
+		for (int k = 0; k < 8; ++k)
+			pack.attr(k) = S::gather(base,
+					S::addi(offs, S::seti(k)), mask);
+		return pack;
+	}
+
+	void set(int i, Vertex const &v)
+	{
+		float const val[8] = { v.pos.x, v.pos.y, v.pos.z,
+				       v.tex.x, v.tex.y,
+				       v.norm.x, v.norm.y, v.norm.z };
+		alignas(64) float tmp[PackWidth];
+		for (int k = 0; k < 8; ++k) {
+			SimdPack::store(tmp, attr(k));
+			tmp[i] = val[k];
+			attr(k) = SimdPack::load(tmp);
+		}
+	}
+
+private:
+	F &attr(int k)
+	{
+		return k < 3 ? pos[k] : k < 5 ? tex[k - 3] : norm[k - 5];
+	}
+
+	F const &attr(int k) const
+	{
+		return k < 3 ? pos[k] : k < 5 ? tex[k - 3] : norm[k - 5];
+	}
+};
+#endif
+
 struct ModelShader : public Shader<Vertex, Vertex, Fbuffer::Color> {
 	void set_window(Window const &wnd) override
 	{
@@ -31,12 +95,19 @@ struct ModelShader : public Shader<Vertex, Vertex, Fbuffer::Color> {
 				(Vec4{1, 1, 1, 1})));
 	}
 
-	void set_tex_img(PpmImg const *tex_img_)
+	void set_tex(Texture const *texture_,
+		TexFilter filter = TexFilter::NEAREST)
 	{
-		tex_img = tex_img_;
-		tex_buf = &tex_img->buf[0];
-		tex_w = tex_img->w;
-		tex_h = tex_img->h;
+		texture = texture_;
+		tex_buf = &texture->buf[0];
+		tex_w = texture->w;
+		tex_h = texture->h;
+		tex_layout = texture->layout;
+		tex_filter = filter;
+#ifdef SIMD_PACK
+		/* Only mip selection reads them */
+		fs_derivs = texture->n_levels > 1;
+#endif
 	}
 
 	VsOut VShader(VsIn const &in) const override
@@ -57,22 +128,341 @@ struct ModelShader : public Shader<Vertex, Vertex, Fbuffer::Color> {
 		return out;
 	}
 
-	PpmImg::Color FShaderGetColor(Vec2 const &tex) const
+#ifdef SIMD_PACK
+	void VShaderPack(VsIn const *in, PackMask mask,
+			VsOut *out) const override
+	{
+		using S = SimdPack;
+		using F = S::F;
+		auto const v = Pack<Vertex>::Load(in, mask);
+
+		/* m * (v, 1) */
+		auto xform = [](Mat4 const &m, F const *v, F (&res)[4]) {
+			for (int i = 0; i < 4; ++i) {
+				F r = S::fmadd(S::set1(m[i][0]), v[0],
+					       S::set1(m[i][3]));
+				r = S::fmadd(S::set1(m[i][1]), v[1], r);
+				res[i] = S::fmadd(S::set1(m[i][2]), v[2], r);
+			}
+		};
+		F mv[4], pr[4], norm[4];
+		xform(modelview_mat, v.pos, mv);
+		for (int i = 0; i < 4; ++i) {
+			F r = S::mul(S::set1(proj_mat[i][0]), mv[0]);
+			for (int j = 1; j < 4; ++j)
+				r = S::fmadd(S::set1(proj_mat[i][j]), mv[j], r);
+			pr[i] = r;
+		}
+		xform(norm_mat, v.norm, norm);
+
+		/* Rows of VsOut: pos, fs_vtx.pos + tex.x, tex.y + norm */
+		F pos[4], fs_lo[4], fs_hi[4];
+		F pr_w = S::div(S::set1(1), pr[3]);
+		F mv_w = S::div(S::set1(1), mv[3]);
+		F norm_w = S::div(S::set1(1), norm[3]);
+		for (int k = 0; k < 3; ++k) {
+			pos[k] = S::fmadd(S::mul(pr[k], pr_w),
+					  S::set1(vp_tr.scale[k]),
+					  S::set1(vp_tr.offs[k]));
+			fs_lo[k] = S::mul(mv[k], mv_w);
+			fs_hi[k + 1] = S::mul(norm[k], norm_w);
+		}
+		pos[3] = pr[3];
+		fs_lo[3] = v.tex[0];
+		fs_hi[0] = v.tex[1];
+
+		int const W = S::width;
+		alignas(64) float aos[3][4 * W];
+		S::Transpose4(pos, aos[0]);
+		S::Transpose4(fs_lo, aos[1]);
+		S::Transpose4(fs_hi, aos[2]);
+		static_assert(sizeof(VsOut) == 12 * sizeof(float));
+		for (; mask; mask &= mask - 1) {
+			int i = __builtin_ctz(mask);
+			float *dst = out[i].pos.data;
+			for (int r = 0; r < 3; ++r)
+				_mm_store_ps(dst + 4 * r, _mm_load_ps(
+					aos[r] + 4 * S::AosSlot(i)));
+		}
+	}
+#endif
+
+	/* Level 0 only, a single fragment has no derivatives to pick a
+	 * level from, so TRILINEAR samples as BILINEAR */
+	Texture::Color FShaderGetColor(Vec2 const &tex) const
 	{
 		int32_t w = tex_w;
 		int32_t h = tex_h;
 
-		int32_t x = (tex.x * w) + 0.5f;
-		int32_t y = h - (tex.y * h) + 0.5f;
+		float u = tex.x * w;
+		float v = h - (tex.y * h);
+		if (tex_filter != TexFilter::NEAREST)
+			return GetBilinear(u, v);
 
+		int32_t x = u + 0.5f;
+		int32_t y = v + 0.5f;
 #ifndef HACK_TRSHADER_NO_BOUNDS
 		if (x >= w) x = w - 1;
 		if (y >= h) y = h - 1;
 		if (x < 0)  x = 0;
 		if (y < 0)  y = 0;
 #endif
-		return tex_img->buf[x + w * y];
+		return texture->get(x, y);
+	}
+
+	/* Same footprint and weights as GetBilinearPack at level 0 */
+	Texture::Color GetBilinear(float u, float v) const
+	{
+		float s = u - 0.5f, t = v - 0.5f;
+		float s0 = std::floor(s), t0 = std::floor(t);
+		int32_t x0 = s0, y0 = t0;
+		int32_t wx = (s - s0) * 256, wy = (t - t0) * 256;
+		auto texel = [this](int32_t x, int32_t y) {
+			x = std::min(std::max(x, 0), tex_w - 1);
+			y = std::min(std::max(y, 0), tex_h - 1);
+			return texture->get(x, y);
+		};
+		auto lerp = [](Texture::Color a, Texture::Color b, int32_t w) {
+			auto ch = [w](uint8_t a, uint8_t b) {
+				return uint8_t((a * (256 - w) + b * w) >> 8);
+			};
+			return Texture::Color { ch(a.b, b.b), ch(a.g, b.g),
+						ch(a.r, b.r), ch(a.a, b.a) };
+		};
+		return lerp(lerp(texel(x0, y0), texel(x0 + 1, y0), wx),
+			    lerp(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), wx),
+			    wy);
+	}
+
+#ifdef SIMD_PACK
+	/* Level parameters per lane, broadcast when the lanes agree */
+	struct TexLevelPack {
+		SimdPack::I w, h, pitch, offs;
+		SimdPack::F scale_x, scale_y;
+	};
+
+	TexLevelPack GetTexLevelPack(SimdPack::I lvl, PackMask mask) const
+	{
+		using S = SimdPack;
+		Texture const &t = *texture;
+		TexLevelPack lp;
+		alignas(64) int32_t lvls[S::width];
+		S::storei(lvls, lvl, S::full);
+		int32_t const l0 = lvls[__builtin_ctz(mask)];
+		if ((S::eqi(lvl, S::seti(l0)) & mask) == mask) {
+			lp.w = S::seti(t.lvl_w[l0]);
+			lp.h = S::seti(t.lvl_h[l0]);
+			lp.pitch = S::seti(t.lvl_pitch[l0]);
+			lp.offs = S::seti(t.lvl_offs[l0]);
+			lp.scale_x = S::set1(t.lvl_scale_x[l0]);
+			lp.scale_y = S::set1(t.lvl_scale_y[l0]);
+			return lp;
+		}
+		S::I offs = S::slli(lvl, 2);
+		lp.w = S::gatheri(t.lvl_w, offs, mask);
+		lp.h = S::gatheri(t.lvl_h, offs, mask);
+		lp.pitch = S::gatheri(t.lvl_pitch, offs, mask);
+		lp.offs = S::gatheri(t.lvl_offs, offs, mask);
+		lp.scale_x = S::gather(t.lvl_scale_x, lvl, mask);
+		lp.scale_y = S::gather(t.lvl_scale_y, lvl, mask);
+		return lp;
+	}
+
+	/* Texel words at x, y of the level, clamped unless no_bounds */
+	SimdPack::I GetTexelPack(SimdPack::I x, SimdPack::I y,
+		TexLevelPack const &lp, PackMask mask,
+		bool no_bounds = false) const
+	{
+		using S = SimdPack;
+		if (!no_bounds) {
+			S::I one = S::seti(1);
+			x = S::maxi(S::mini(x, S::subi(lp.w, one)), S::seti(0));
+			y = S::maxi(S::mini(y, S::subi(lp.h, one)), S::seti(0));
+		}
+		if (tex_layout == TexLayout::BC1) {
+			int const shift = Texture::BLOCK_SHIFT;
+			S::I in_mask = S::seti(Texture::BLOCK_SIZE - 1);
+			S::I block = S::addi(S::srli(x, shift), S::muli(
+				S::srli(y, shift), lp.pitch));
+			S::I addr = S::slli(S::addi(lp.offs,
+						    S::slli(block, 1)), 2);
+			S::I texel = S::ori(S::slli(S::andi(y, in_mask), shift),
+					    S::andi(x, in_mask));
+			return DecodeBc1Pack(S::gatheri(tex_buf, addr, mask),
+				S::gatheri(tex_buf, S::addi(addr, S::seti(4)),
+					   mask), texel);
+		}
+		S::I ind;
+		if (tex_layout == TexLayout::LINEAR) {
+			ind = S::addi(x, S::muli(y, lp.pitch));
+		} else {
+			int const shift = Texture::BLOCK_SHIFT;
+			S::I in_mask = S::seti(Texture::BLOCK_SIZE - 1);
+			S::I block = S::addi(S::srli(x, shift), S::muli(
+				S::srli(y, shift), lp.pitch));
+			ind = S::ori(S::slli(block, 2 * shift),
+				     S::slli(S::andi(y, in_mask), shift));
+			ind = S::ori(ind, S::andi(x, in_mask));
+		}
+		ind = S::addi(ind, lp.offs);
+		static_assert(sizeof(Texture::Color) == 4);
+		return S::gatheri(tex_buf, S::slli(ind, 2), mask);
+	}
+
+	/* Texel of a BC1 block as Texture::Bc1Color */
+	static SimdPack::I DecodeBc1Pack(SimdPack::I ends, SimdPack::I bits,
+		SimdPack::I texel)
+	{
+		using S = SimdPack;
+		S::I three = S::seti(3);
+		S::I sel = S::andi(S::srlvi(bits, S::slli(texel, 1)), three);
+		S::I w1 = S::andi(S::srlvi(S::seti(Texture::BC1_W1),
+					   S::slli(sel, 1)), three);
+		auto expand = [](S::I c) {
+			S::I r = S::andi(S::srli(c, 11), S::seti(31));
+			S::I g = S::andi(S::srli(c, 5), S::seti(63));
+			S::I b = S::andi(c, S::seti(31));
+			r = S::ori(S::slli(r, 3), S::srli(r, 2));
+			g = S::ori(S::slli(g, 2), S::srli(g, 4));
+			b = S::ori(S::slli(b, 3), S::srli(b, 2));
+			return S::ori(S::ori(S::slli(r, 16), S::slli(g, 8)), b);
+		};
+		S::I c0 = expand(S::andi(ends, S::seti(0xffff)));
+		S::I c1 = expand(S::srli(ends, 16));
+
+		/* Thirds in 16-bit halves, x / 3 == x * 0x5556 >> 16 here */
+		S::I even = S::seti(0x00ff00ff);
+		w1 = S::ori(w1, S::slli(w1, 16));
+		S::I w0 = S::subi(S::seti(0x00030003), w1);
+		S::I rb = S::addi(S::mul16i(S::andi(c0, even), w0),
+				  S::mul16i(S::andi(c1, even), w1));
+		S::I g = S::addi(S::mul16i(S::srli(S::andi(c0, S::seti(0xff00)), 8), w0),
+				 S::mul16i(S::srli(S::andi(c1, S::seti(0xff00)), 8), w1));
+		S::I third = S::seti(0x55565556);
+		rb = S::mulhi16i(rb, third);
+		g = S::mulhi16i(g, third);
+		return S::ori(S::ori(rb, S::slli(g, 8)),
+			      S::seti(int32_t(0xff000000)));
+	}
+
+	/* a + (b - a) * w / 256 per byte channel, w in 0..256 */
+	static SimdPack::I LerpColorPack(SimdPack::I a, SimdPack::I b,
+		SimdPack::I w)
+	{
+		using S = SimdPack;
+		S::I even = S::seti(0x00ff00ff);
+		/* Two channels per lane in 16-bit halves, products fit */
+		w = S::ori(w, S::slli(w, 16));
+		S::I w_a = S::subi(S::seti(0x01000100), w);
+		S::I lo = S::addi(S::mul16i(S::andi(a, even), w_a),
+				  S::mul16i(S::andi(b, even), w));
+		S::I hi = S::addi(S::mul16i(S::andi(S::srli(a, 8), even), w_a),
+				  S::mul16i(S::andi(S::srli(b, 8), even), w));
+		return S::ori(S::andi(S::srli(lo, 8), even),
+			      S::andi(hi, S::seti(int32_t(0xff00ff00))));
+	}
+
+	/* u, v in texels of level 0 with texel centers at .5, scaled to
+	 * the level before the half texel shift, so texel centers of every
+	 * level sample one texel */
+	SimdPack::I GetBilinearPack(SimdPack::F u, SimdPack::F v,
+		TexLevelPack const &lp, PackMask mask) const
+	{
+		using S = SimdPack;
+		S::F half = S::set1(0.5f);
+		S::F s = S::sub(S::mul(u, lp.scale_x), half);
+		S::F t = S::sub(S::mul(v, lp.scale_y), half);
+		S::F s0 = S::floor(s), t0 = S::floor(t);
+		S::I x0 = S::cvtt(s0), y0 = S::cvtt(t0);
+		S::I x1 = S::addi(x0, S::seti(1)), y1 = S::addi(y0, S::seti(1));
+		S::F frac = S::set1(256);
+		S::I wx = S::cvtt(S::mul(S::sub(s, s0), frac));
+		S::I wy = S::cvtt(S::mul(S::sub(t, t0), frac));
+		S::I c00 = GetTexelPack(x0, y0, lp, mask);
+		S::I c10 = GetTexelPack(x1, y0, lp, mask);
+		S::I c01 = GetTexelPack(x0, y1, lp, mask);
+		S::I c11 = GetTexelPack(x1, y1, lp, mask);
+		return LerpColorPack(LerpColorPack(c00, c10, wx),
+				     LerpColorPack(c01, c11, wx), wy);
+	}
+
+	/* log2 of texels per pixel, from the larger screen axis */
+	SimdPack::F GetTexLodPack(FsInPack const &in) const
+	{
+		using S = SimdPack;
+		using F = S::F;
+		F w = S::set1(float(tex_w));
+		F h = S::set1(float(tex_h));
+		F dxu = S::mul(in.tex_dx[0], w), dxv = S::mul(in.tex_dx[1], h);
+		F dyu = S::mul(in.tex_dy[0], w), dyv = S::mul(in.tex_dy[1], h);
+		F rho2 = S::max(S::fmadd(dxu, dxu, S::mul(dxv, dxv)),
+				S::fmadd(dyu, dyu, S::mul(dyv, dyv)));
+
+		/* log2 ~ exponent + mantissa - 1, exact at powers of 2 */
+		S::I bits = S::casti(rho2);
+		F e = S::cvtf(S::subi(S::srli(bits, 23), S::seti(127)));
+		F m = S::castf(S::ori(S::andi(bits, S::seti(0x7fffff)),
+				      S::seti(0x3f800000)));
+		F lod = S::mul(S::add(e, S::sub(m, S::set1(1))),
+			       S::set1(0.5f));
+		lod = S::max(lod, S::set1(0));
+		return S::min(lod, S::set1(float(texture->n_levels - 1)));
+	}
+
+	/* Texels as Fbuffer::Color words, lanes out of mask are 0 */
+	SimdPack::I FShaderGetColorPack(FsInPack const &in,
+			PackMask mask) const
+	{
+		using S = SimdPack;
+		S::F w = S::set1(float(tex_w));
+		S::F h = S::set1(float(tex_h));
+		S::F u = S::mul(in.tex[0], w);
+		S::F v = S::sub(h, S::mul(in.tex[1], h));
+
+		S::F lod = S::set1(0);
+		if (texture->n_levels > 1)
+			lod = GetTexLodPack(in);
+
+		if (tex_filter == TexFilter::TRILINEAR) {
+			S::I l0 = S::cvtt(lod);
+			S::I l1 = S::mini(S::addi(l0, S::seti(1)),
+				S::seti(texture->n_levels - 1));
+			S::F frac = S::sub(lod, S::cvtf(l0));
+			S::I c0 = GetBilinearPack(u, v,
+				GetTexLevelPack(l0, mask), mask);
+			if (!(S::gt(frac, S::set1(0)) & mask))
+				return c0;
+			S::I c1 = GetBilinearPack(u, v,
+				GetTexLevelPack(l1, mask), mask);
+			return LerpColorPack(c0, c1,
+				S::cvtt(S::mul(frac, S::set1(256))));
+		}
+
+		auto lp = GetTexLevelPack(S::cvtt(S::add(lod, S::set1(0.5f))),
+					  mask);
+		if (tex_filter == TexFilter::BILINEAR)
+			return GetBilinearPack(u, v, lp, mask);
+
+		S::F half = S::set1(0.5f);
+		S::I x = S::cvtt(S::mul(S::add(u, half), lp.scale_x));
+		S::I y = S::cvtt(S::mul(S::add(v, half), lp.scale_y));
+#ifndef HACK_TRSHADER_NO_BOUNDS
+		return GetTexelPack(x, y, lp, mask);
+#else
+		return GetTexelPack(x, y, lp, mask, true);
+#endif
+	}
+
+	/* Channels of 0..255 -> Fbuffer::Color */
+	static SimdPack::I ToColorPack(SimdPack::F r, SimdPack::F g,
+			SimdPack::F b)
+	{
+		using S = SimdPack;
+		S::I c = S::ori(S::cvtt(b), S::slli(S::cvtt(g), 8));
+		c = S::ori(c, S::slli(S::cvtt(r), 16));
+		return S::ori(c, S::seti(int32_t(0xff000000)));
 	}
+#endif
 
 	virtual FsOut FShader(FsIn const &in) const override = 0;
 
@@ -83,9 +473,11 @@ protected:
 	Mat4 norm_mat;
 
 	Vec3 light;
-	PpmImg const *tex_img;
-	PpmImg::Color const *tex_buf;
+	Texture const *texture;
+	Texture::Color const *tex_buf;
 	int32_t tex_w, tex_h;
+	TexLayout tex_layout;
+	TexFilter tex_filter;
 };
 
 struct TexShader final: public ModelShader {
@@ -93,8 +485,17 @@ public:
 	FsOut FShader(FsIn const &in) const override
 	{
 		auto c = FShaderGetColor(in.tex);
-		return Fbuffer::Color { c.b, c.g, c.r, 255 };
+		return Fbuffer::Color { c.b, c.g, c.r, c.a };
 	}
+
+#ifdef SIMD_PACK
+	void FShaderPack(FsInPack const &in, PackMask mask,
+			FsOut *out) const override
+	{
+		using S = SimdPack;
+		S::storei(out, FShaderGetColorPack(in, mask), mask);
+	}
+#endif
 };
 
 struct TexHighlShader final: public ModelShader {
@@ -119,4 +520,47 @@ public:
 					uint8_t(c.g * intens),
 					uint8_t(c.r * intens), 255 };
 	}
+
+#ifdef SIMD_PACK
+	void FShaderPack(FsInPack const &in, PackMask mask,
+			FsOut *out) const override
+	{
+		using S = SimdPack;
+		using F = S::F;
+		F const zero = S::set1(0);
+
+		F pos_len2 = S::mul(in.pos[0], in.pos[0]);
+		pos_len2 = S::fmadd(in.pos[1], in.pos[1], pos_len2);
+		pos_len2 = S::fmadd(in.pos[2], in.pos[2], pos_len2);
+		F pos_len = S::sqrt(pos_len2);
+
+		F dot_d = S::mul(S::set1(light.x), in.norm[0]);
+		dot_d = S::fmadd(S::set1(light.y), in.norm[1], dot_d);
+		dot_d = S::fmadd(S::set1(light.z), in.norm[2], dot_d);
+
+		F dot_s = zero;
+		F dot_d2 = S::add(dot_d, dot_d);
+		for (int k = 0; k < 3; ++k) {
+			F refl = S::sub(S::set1(light[k]),
+					S::mul(dot_d2, in.norm[k]));
+			dot_s = S::fmadd(refl, in.pos[k], dot_s);
+		}
+		dot_s = S::div(dot_s, pos_len);
+
+		dot_d = S::max(zero, dot_d);
+		dot_s = S::max(zero, dot_s);
+		F spec = dot_s;
+		for (int i = 0; i < 5; ++i)	/* ^32 */
+			spec = S::mul(spec, spec);
+		F intens = S::fmadd(S::set1(0.24f), dot_d, S::set1(0.35f));
+		intens = S::fmadd(S::set1(0.40f), spec, intens);
+
+		S::I c = FShaderGetColorPack(in, mask);
+		S::I byte = S::seti(0xff);
+		F b = S::mul(S::cvtf(S::andi(c, byte)), intens);
+		F g = S::mul(S::cvtf(S::andi(S::srli(c, 8), byte)), intens);
+		F r = S::mul(S::cvtf(S::andi(S::srli(c, 16), byte)), intens);
+		S::storei(out, ToColorPack(r, g, b), mask);
+	}
+#endif
 };
@@ -0,0 +1,487 @@
+#pragma once
+
+#include <cstdint>
+#include <immintrin.h>
+
+/* Float lane packs for tile rows, W pixels per instruction */
+
+#ifdef __AVX2__
+#define SIMD_AVX2
+#endif
+#ifdef __AVX512F__
+#define SIMD_AVX512
+#endif
+
+#ifdef SIMD_AVX2
+struct Simd8 {
+	static constexpr int width = 8;
+	using F = __m256;
+	using I = __m256i;
+	using Mask = uint32_t;
+	static constexpr Mask full = 0xff;
+
+	static F set1(float a)
+	{
+		return _mm256_set1_ps(a);
+	}
+	static F lanes()
+	{
+		return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	}
+	static F add(F a, F b)
+	{
+		return _mm256_add_ps(a, b);
+	}
+	static F sub(F a, F b)
+	{
+		return _mm256_sub_ps(a, b);
+	}
+	static F mul(F a, F b)
+	{
+		return _mm256_mul_ps(a, b);
+	}
+	static F div(F a, F b)
+	{
+		return _mm256_div_ps(a, b);
+	}
+	static F min(F a, F b)
+	{
+		return _mm256_min_ps(a, b);
+	}
+	static F max(F a, F b)
+	{
+		return _mm256_max_ps(a, b);
+	}
+	static F fmadd(F a, F b, F c)
+	{
+		return _mm256_fmadd_ps(a, b, c);
+	}
+	static F sqrt(F a)
+	{
+		return _mm256_sqrt_ps(a);
+	}
+	static F floor(F a)
+	{
+		return _mm256_floor_ps(a);
+	}
+	static Mask ge(F a, F b)
+	{
+		return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GE_OQ));
+	}
+	static F load(float const *p)
+	{
+		return _mm256_load_ps(p);
+	}
+	static void store(float *p, F a)
+	{
+		_mm256_store_ps(p, a);
+	}
+	static I loadi(void const *p)
+	{
+		return _mm256_load_si256(static_cast<__m256i const *>(p));
+	}
+	/* Non-temporal, p aligned to the pack, needs a fence before other
+	 * threads read it */
+	static void streami(void *p, I a)
+	{
+		_mm256_stream_si256(static_cast<__m256i *>(p), a);
+	}
+	/* base[i * stride] */
+	static F gather(float const *base, int32_t stride)
+	{
+		__m256i idx = _mm256_mullo_epi32(
+			_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+			_mm256_set1_epi32(stride));
+		return _mm256_i32gather_ps(base, idx, 4);
+	}
+	/* Lanes of v[0..3] -> Vec4 per lane, lane i at out + 4 * AosSlot(i) */
+	static void Transpose4(F const (&v)[4], float *out)
+	{
+		F t0 = _mm256_unpacklo_ps(v[0], v[1]);
+		F t1 = _mm256_unpackhi_ps(v[0], v[1]);
+		F t2 = _mm256_unpacklo_ps(v[2], v[3]);
+		F t3 = _mm256_unpackhi_ps(v[2], v[3]);
+		_mm256_store_ps(out +  0, _mm256_shuffle_ps(t0, t2, 0x44));
+		_mm256_store_ps(out +  8, _mm256_shuffle_ps(t0, t2, 0xee));
+		_mm256_store_ps(out + 16, _mm256_shuffle_ps(t1, t3, 0x44));
+		_mm256_store_ps(out + 24, _mm256_shuffle_ps(t1, t3, 0xee));
+	}
+	static int AosSlot(int i)
+	{
+		return (i & 3) * (width / 4) + (i >> 2);
+	}
+
+	static I seti(int32_t a)
+	{
+		return _mm256_set1_epi32(a);
+	}
+	static I lanesi()
+	{
+		return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	}
+	static I addi(I a, I b)
+	{
+		return _mm256_add_epi32(a, b);
+	}
+	static I subi(I a, I b)
+	{
+		return _mm256_sub_epi32(a, b);
+	}
+	static I muli(I a, I b)
+	{
+		return _mm256_mullo_epi32(a, b);
+	}
+	/* Low and high halves of unsigned 16-bit products */
+	static I mul16i(I a, I b)
+	{
+		return _mm256_mullo_epi16(a, b);
+	}
+	static I mulhi16i(I a, I b)
+	{
+		return _mm256_mulhi_epu16(a, b);
+	}
+	static I ori(I a, I b)
+	{
+		return _mm256_or_si256(a, b);
+	}
+	/* Lanes with sign bit set */
+	static Mask negi(I a)
+	{
+		return _mm256_movemask_ps(_mm256_castsi256_ps(a));
+	}
+
+	/* Bit mask -> all-ones lanes */
+	static I maski(Mask m)
+	{
+		__m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+		return _mm256_cmpeq_epi32(_mm256_and_si256(
+			_mm256_set1_epi32(m), bits), bits);
+	}
+	static Mask lt(F a, F b)
+	{
+		return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+	}
+	static Mask gt(F a, F b)
+	{
+		return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ));
+	}
+	/* Lanes of b in m, of a otherwise */
+	static F blend(Mask m, F a, F b)
+	{
+		return _mm256_blendv_ps(a, b, _mm256_castsi256_ps(maski(m)));
+	}
+	/* base[idx[i]] for lanes in m, 0 otherwise */
+	static F gather(float const *base, I idx, Mask m)
+	{
+		return _mm256_mask_i32gather_ps(_mm256_setzero_ps(), base,
+			idx, _mm256_castsi256_ps(maski(m)), 4);
+	}
+	/* base[i * stride] */
+	static I gatheri(int32_t const *base, int32_t stride)
+	{
+		return _mm256_i32gather_epi32(base, muli(lanesi(),
+					      seti(stride)), 4);
+	}
+	/* 4 bytes at base + offs[i] for lanes in m, 0 otherwise */
+	static I gatheri(void const *base, I offs, Mask m)
+	{
+		return _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+			static_cast<int const *>(base), offs, maski(m), 1);
+	}
+	static void storei(void *p, I a, Mask m)
+	{
+		_mm256_maskstore_epi32(static_cast<int *>(p), maski(m), a);
+	}
+	static Mask eqi(I a, I b)
+	{
+		return _mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_cmpeq_epi32(a, b)));
+	}
+	static I andi(I a, I b)
+	{
+		return _mm256_and_si256(a, b);
+	}
+	static I mini(I a, I b)
+	{
+		return _mm256_min_epi32(a, b);
+	}
+	static I maxi(I a, I b)
+	{
+		return _mm256_max_epi32(a, b);
+	}
+	static I slli(I a, int n)
+	{
+		return _mm256_slli_epi32(a, n);
+	}
+	static I srli(I a, int n)
+	{
+		return _mm256_srli_epi32(a, n);
+	}
+	/* Per-lane shift counts */
+	static I srlvi(I a, I n)
+	{
+		return _mm256_srlv_epi32(a, n);
+	}
+	/* Truncating, as float -> int cast */
+	static I cvtt(F a)
+	{
+		return _mm256_cvttps_epi32(a);
+	}
+	static F cvtf(I a)
+	{
+		return _mm256_cvtepi32_ps(a);
+	}
+	/* Bit casts */
+	static I casti(F a)
+	{
+		return _mm256_castps_si256(a);
+	}
+	static F castf(I a)
+	{
+		return _mm256_castsi256_ps(a);
+	}
+};
+#endif
+
+#ifdef SIMD_AVX512
+struct Simd16 {
+	static constexpr int width = 16;
+	using F = __m512;
+	using I = __m512i;
+	using Mask = uint32_t;
+	static constexpr Mask full = 0xffff;
+
+	static F set1(float a)
+	{
+		return _mm512_set1_ps(a);
+	}
+	static F lanes()
+	{
+		return _mm512_setr_ps(0, 1, 2,  3,  4,  5,  6,  7,
+				      8, 9, 10, 11, 12, 13, 14, 15);
+	}
+	static F add(F a, F b)
+	{
+		return _mm512_add_ps(a, b);
+	}
+	static F sub(F a, F b)
+	{
+		return _mm512_sub_ps(a, b);
+	}
+	static F mul(F a, F b)
+	{
+		return _mm512_mul_ps(a, b);
+	}
+	static F div(F a, F b)
+	{
+		return _mm512_div_ps(a, b);
+	}
+	static F min(F a, F b)
+	{
+		return _mm512_min_ps(a, b);
+	}
+	static F max(F a, F b)
+	{
+		return _mm512_max_ps(a, b);
+	}
+	static F fmadd(F a, F b, F c)
+	{
+		return _mm512_fmadd_ps(a, b, c);
+	}
+	static F sqrt(F a)
+	{
+		return _mm512_sqrt_ps(a);
+	}
+	static F floor(F a)
+	{
+		return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF |
+					    _MM_FROUND_NO_EXC);
+	}
+	static Mask ge(F a, F b)
+	{
+		return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ);
+	}
+	static F load(float const *p)
+	{
+		return _mm512_load_ps(p);
+	}
+	static void store(float *p, F a)
+	{
+		_mm512_store_ps(p, a);
+	}
+	static I loadi(void const *p)
+	{
+		return _mm512_load_si512(p);
+	}
+	static void streami(void *p, I a)
+	{
+		_mm512_stream_si512(static_cast<__m512i *>(p), a);
+	}
+	static F gather(float const *base, int32_t stride)
+	{
+		__m512i idx = _mm512_mullo_epi32(
+			_mm512_setr_epi32(0, 1, 2,  3,  4,  5,  6,  7,
+					  8, 9, 10, 11, 12, 13, 14, 15),
+			_mm512_set1_epi32(stride));
+		return _mm512_i32gather_ps(idx, base, 4);
+	}
+	static void Transpose4(F const (&v)[4], float *out)
+	{
+		F t0 = _mm512_unpacklo_ps(v[0], v[1]);
+		F t1 = _mm512_unpackhi_ps(v[0], v[1]);
+		F t2 = _mm512_unpacklo_ps(v[2], v[3]);
+		F t3 = _mm512_unpackhi_ps(v[2], v[3]);
+		_mm512_store_ps(out +  0, _mm512_shuffle_ps(t0, t2, 0x44));
+		_mm512_store_ps(out + 16, _mm512_shuffle_ps(t0, t2, 0xee));
+		_mm512_store_ps(out + 32, _mm512_shuffle_ps(t1, t3, 0x44));
+		_mm512_store_ps(out + 48, _mm512_shuffle_ps(t1, t3, 0xee));
+	}
+	static int AosSlot(int i)
+	{
+		return (i & 3) * (width / 4) + (i >> 2);
+	}
+
+	static I seti(int32_t a)
+	{
+		return _mm512_set1_epi32(a);
+	}
+	static I lanesi()
+	{
+		return _mm512_setr_epi32(0, 1, 2,  3,  4,  5,  6,  7,
+					 8, 9, 10, 11, 12, 13, 14, 15);
+	}
+	static I addi(I a, I b)
+	{
+		return _mm512_add_epi32(a, b);
+	}
+	static I subi(I a, I b)
+	{
+		return _mm512_sub_epi32(a, b);
+	}
+	static I muli(I a, I b)
+	{
+		return _mm512_mullo_epi32(a, b);
+	}
+#ifdef __AVX512BW__
+	static I mul16i(I a, I b)
+	{
+		return _mm512_mullo_epi16(a, b);
+	}
+	static I mulhi16i(I a, I b)
+	{
+		return _mm512_mulhi_epu16(a, b);
+	}
+#else
+	static I mul16i(I a, I b)
+	{
+		return Halves(a, b, _mm256_mullo_epi16);
+	}
+	static I mulhi16i(I a, I b)
+	{
+		return Halves(a, b, _mm256_mulhi_epu16);
+	}
+	template <typename _op>
+	static I Halves(I a, I b, _op op)
+	{
+		__m256i lo = op(_mm512_castsi512_si256(a),
+				_mm512_castsi512_si256(b));
+		__m256i hi = op(_mm512_extracti64x4_epi64(a, 1),
+				_mm512_extracti64x4_epi64(b, 1));
+		return _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+	}
+#endif
+	static I ori(I a, I b)
+	{
+		return _mm512_or_si512(a, b);
+	}
+	static Mask negi(I a)
+	{
+		return _mm512_cmplt_epi32_mask(a, _mm512_setzero_si512());
+	}
+
+	static Mask lt(F a, F b)
+	{
+		return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+	}
+	static Mask gt(F a, F b)
+	{
+		return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);
+	}
+	static F blend(Mask m, F a, F b)
+	{
+		return _mm512_mask_blend_ps(m, a, b);
+	}
+	static F gather(float const *base, I idx, Mask m)
+	{
+		return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), m,
+						idx, base, 4);
+	}
+	static I gatheri(int32_t const *base, int32_t stride)
+	{
+		return _mm512_i32gather_epi32(muli(lanesi(), seti(stride)),
+					      base, 4);
+	}
+	static I gatheri(void const *base, I offs, Mask m)
+	{
+		return _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), m,
+						   offs, base, 1);
+	}
+	static void storei(void *p, I a, Mask m)
+	{
+		_mm512_mask_storeu_epi32(p, m, a);
+	}
+	static Mask eqi(I a, I b)
+	{
+		return _mm512_cmpeq_epi32_mask(a, b);
+	}
+	static I andi(I a, I b)
+	{
+		return _mm512_and_si512(a, b);
+	}
+	static I mini(I a, I b)
+	{
+		return _mm512_min_epi32(a, b);
+	}
+	static I maxi(I a, I b)
+	{
+		return _mm512_max_epi32(a, b);
+	}
+	static I slli(I a, int n)
+	{
+		return _mm512_slli_epi32(a, n);
+	}
+	static I srli(I a, int n)
+	{
+		return _mm512_srli_epi32(a, n);
+	}
+	static I srlvi(I a, I n)
+	{
+		return _mm512_srlv_epi32(a, n);
+	}
+	static I cvtt(F a)
+	{
+		return _mm512_cvttps_epi32(a);
+	}
+	static F cvtf(I a)
+	{
+		return _mm512_cvtepi32_ps(a);
+	}
+	static I casti(F a)
+	{
+		return _mm512_castps_si512(a);
+	}
+	static F castf(I a)
+	{
+		return _mm512_castsi512_ps(a);
+	}
+};
+#endif
+
+/* Widest available, width of fragment packets in shading */
+#if defined(SIMD_AVX512)
+#define SIMD_PACK
+using SimdPack = Simd16;
+#elif defined(SIMD_AVX2)
+#define SIMD_PACK
+using SimdPack = Simd8;
+#endif
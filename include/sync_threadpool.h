@@ -1,24 +1,57 @@
 #pragma once
 
+#include <include/perf_stats.h>
+
 #include <thread>
 #include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <vector>
 #include <functional>
+#include <climits>
 #include <cassert>
 #include <cstdint>
 
+extern "C" {
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+#include <immintrin.h>
+
+/* Pause iterations before parking on futex, no spinning when the pool
+ * oversubscribes the CPU */
+#ifndef SYNC_THREADPOOL_SPIN_COUNT
+#define SYNC_THREADPOOL_SPIN_COUNT 4096
+#endif
+
+enum class SyncThreadpoolBarrierType {
+	CONDVAR,	/* mutex + condvar handshakes */
+	SPIN_FUTEX,	/* spin, then sleep on futex */
+};
+
+inline void FutexWait(std::atomic<uint32_t> *addr, uint32_t val)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+		FUTEX_WAIT_PRIVATE, val, nullptr, nullptr, 0);
+}
+
+inline void FutexWakeAll(std::atomic<uint32_t> *addr)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+		FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
 struct SyncThreadpoolEnv {
 	friend struct SyncThreadpool;
 private:
 	uint32_t n_threads = 0;
 	std::vector<std::thread> pool;
-	std::atomic<int> task_id;
+	alignas(64) std::atomic<int> task_id;
 	std::function<void(int, int)> task;
 
 	size_t run_gen = 0;
-	std::atomic<int> n_run;
+	std::atomic<int> n_run{0};
 	std::condition_variable cv_run;
 	std::mutex m_done;
 
@@ -30,18 +63,58 @@ private:
 	std::mutex m_ready;
 	bool finish = false;
 
+	/* SPIN_FUTEX state, each on its own line */
+	alignas(64) std::atomic<uint32_t> start_gen{0};
+	alignas(64) std::atomic<uint32_t> n_pending{0};
+	alignas(64) std::atomic<uint32_t> n_sleepers{0};
+	std::atomic<uint32_t> owner_sleeping{0};
+	std::atomic<int> spin_count{SYNC_THREADPOOL_SPIN_COUNT};
+
+#ifdef PERF_STATS
+	std::vector<PerfThreadStat> stats;
+	uint64_t run_ns = 0;	/* workers released, read after wake */
+#endif
+
 	void worker(int worker_id);
+	void worker_spin(int worker_id, uint32_t gen);
+	void execute(int worker_id);
 	bool start_barrier();
 	void run_barrier();
+	void wait_start_gen(uint32_t gen);
+	void wait_pending();
 };
 
+inline void SyncThreadpoolEnv::execute(int worker_id)
+{
+	int caught;
+#ifdef PERF_STATS
+	uint64_t n_tasks = 0;
+#ifdef PERF_LLC
+	int64_t const llc0 = PerfLlcMisses();
+#endif
+	uint64_t t0 = PerfClockNs();
+	stats[worker_id].start_ns = t0 > run_ns ? t0 - run_ns : 0;
+	while ((caught = --task_id) >= 0) {
+		task(worker_id, caught);
+		++n_tasks;
+	}
+	auto &st = stats[worker_id];
+	st.arrive_ns = PerfClockNs();
+#ifdef PERF_LLC
+	st.llc_misses = llc0 < 0 ? -1 : PerfLlcMisses() - llc0;
+#endif
+	st.busy_ns = st.arrive_ns - t0;
+	st.n_tasks = n_tasks;
+#else
+	while ((caught = --task_id) >= 0)
+		task(worker_id, caught);
+#endif
+}
+
 inline void SyncThreadpoolEnv::worker(int worker_id)
 {
 	while (start_barrier()) {
-		int caught;
-		while ((caught = --task_id) >= 0)
-			task(worker_id, caught);
-
+		execute(worker_id);
 		run_barrier();
 	}
 }
@@ -78,33 +151,116 @@ inline void SyncThreadpoolEnv::run_barrier()
 		cv_run.wait(lk);
 }
 
+inline void SyncThreadpoolEnv::worker_spin(int worker_id, uint32_t gen)
+{
+	while (true) {
+		wait_start_gen(gen);
+		gen = start_gen.load(std::memory_order_acquire);
+		if (finish)
+			return;
+
+		execute(worker_id);
+
+		/* Last one wakes the owner if it went to sleep */
+		if (n_pending.fetch_sub(1) == 1 && owner_sleeping.load())
+			FutexWakeAll(&n_pending);
+	}
+}
+
+inline void SyncThreadpoolEnv::wait_start_gen(uint32_t gen)
+{
+	int const n_spin = spin_count.load(std::memory_order_relaxed);
+	for (int i = 0; i < n_spin; ++i) {
+		if (start_gen.load(std::memory_order_acquire) != gen)
+			return;
+		_mm_pause();
+	}
+	++n_sleepers;
+	while (start_gen.load() == gen)
+		FutexWait(&start_gen, gen);
+	--n_sleepers;
+}
+
+inline void SyncThreadpoolEnv::wait_pending()
+{
+	int const n_spin = spin_count.load(std::memory_order_relaxed);
+	for (int i = 0; i < n_spin; ++i) {
+		if (n_pending.load(std::memory_order_acquire) == 0)
+			return;
+		_mm_pause();
+	}
+	owner_sleeping = 1;
+	uint32_t val;
+	while ((val = n_pending.load()) != 0)
+		FutexWait(&n_pending, val);
+	owner_sleeping = 0;
+}
+
 struct SyncThreadpool {
 private:
 	struct SyncThreadpoolEnv env;
 	bool running = false; /* Track run/wait completion */
+	SyncThreadpoolBarrierType const type;
+	bool const caller_runs; /* Owner executes tasks as extra worker */
+
+	/* Workers and the owner all spin in SPIN_FUTEX, the owner in
+	 * wait_pending even if it runs no tasks */
+	void update_spin_count()
+	{
+		uint32_t const n_spinners = env.n_threads + 1;
+		env.spin_count = n_spinners > std::thread::hardware_concurrency()
+			? 0 : SYNC_THREADPOOL_SPIN_COUNT;
+	}
 public:
-	SyncThreadpool()
+	SyncThreadpool(SyncThreadpoolBarrierType type_ =
+			SyncThreadpoolBarrierType::CONDVAR,
+		       bool caller_runs_ = false) :
+		type(type_), caller_runs(caller_runs_)
 	{
 		env.n_threads = 0;
+#ifdef PERF_STATS
+		env.stats.resize(get_concurrency());
+#endif
 	}
 
 	void add_concurrency(uint32_t n_thr)
 	{
 		if (running)
 			wait_completion();
+#ifdef PERF_STATS
+		env.stats.resize(get_concurrency() + n_thr);
+#endif
 
-		for (int id = env.n_threads; id < env.n_threads + n_thr; ++id)
-			env.pool.push_back(std::thread(
-				&SyncThreadpoolEnv::worker, &env, id));
+		/* Set before any worker can reach run_barrier */
+		env.n_run = env.n_threads + n_thr;
+		uint32_t gen = env.start_gen;
+		for (int id = env.n_threads; id < env.n_threads + n_thr; ++id) {
+			if (type == SyncThreadpoolBarrierType::CONDVAR)
+				env.pool.push_back(std::thread(
+					&SyncThreadpoolEnv::worker, &env, id));
+			else
+				env.pool.push_back(std::thread(
+					&SyncThreadpoolEnv::worker_spin,
+					&env, id, gen));
+		}
 
 		env.n_threads += n_thr;
-		env.n_run = env.n_threads;
+		update_spin_count();
 	}
 
+	/* Including owner thread if it participates */
 	uint32_t get_concurrency()
 	{
-		return env.n_threads;
+		return env.n_threads + (caller_runs ? 1 : 0);
+	}
+
+#ifdef PERF_STATS
+	/* Per-worker stats of the last completed run */
+	std::vector<PerfThreadStat> const &get_stats() const
+	{
+		return env.stats;
 	}
+#endif
 
 	~SyncThreadpool()
 	{
@@ -112,7 +268,13 @@ public:
 			wait_completion();
 
 		env.finish = true;
-		run();
+		if (type == SyncThreadpoolBarrierType::CONDVAR) {
+			if (env.n_threads)
+				run();
+		} else {
+			++env.start_gen;
+			FutexWakeAll(&env.start_gen);
+		}
 		for (auto &t : env.pool)
 			t.join();
 	}
@@ -125,12 +287,27 @@ public:
 
 	void run()
 	{
-		assert(env.n_threads);
+		assert(get_concurrency());
 
 		if (running == true)
 			assert(!"Already running!");
 		running = true;
+#ifdef PERF_STATS
+		env.run_ns = PerfClockNs();
+#endif
+
+		if (type == SyncThreadpoolBarrierType::SPIN_FUTEX) {
+			env.n_pending = env.n_threads;
+			++env.start_gen;
+			if (env.n_sleepers.load())
+				FutexWakeAll(&env.start_gen);
+			return;
+		}
 
+		/* Without workers nobody would clear start, later ones
+		 * would then pass start_barrier before a run */
+		if (!env.n_threads)
+			return;
 		{ /* Allow execution */
 			std::lock_guard<std::mutex> lk(env.m_start);
 			env.start = true;
@@ -144,9 +321,23 @@ public:
 			assert(!"Already finished!");
 		running = false;
 
-		/* Wait for and accept notification */
-		std::unique_lock<std::mutex> lk(env.m_ready);
-		while (!env.ready) env.cv_ready.wait(lk);
-		env.ready = false;
+		if (caller_runs && !env.finish)
+			env.execute(env.n_threads);
+
+		if (type == SyncThreadpoolBarrierType::SPIN_FUTEX) {
+			env.wait_pending();
+		} else if (env.n_threads) { /* Wait for and accept notification */
+			std::unique_lock<std::mutex> lk(env.m_ready);
+			while (!env.ready) env.cv_ready.wait(lk);
+			env.ready = false;
+		}
+#ifdef PERF_STATS
+		/* Everyone waited for the last one */
+		uint64_t last = 0;
+		for (auto const &st : env.stats)
+			last = std::max(last, st.arrive_ns);
+		for (auto &st : env.stats)
+			st.barrier_ns = last - st.arrive_ns;
+#endif
 	}
 };
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <include/ppm.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+enum class TexLayout {
+	LINEAR,	/* row-major */
+	BLOCK,	/* BLOCK_SIZE^2 texel blocks, one cache line each */
+	BC1,	/* BLOCK_SIZE^2 texel blocks compressed into 8 bytes */
+};
+
+enum class TexFilter {
+	NEAREST,	/* nearest texel of the nearest level */
+	BILINEAR,	/* 2x2 texels of the nearest level */
+	TRILINEAR,	/* 2x2 texels of the two nearest levels */
+};
+
+/* Sampling copy of an image with optional mip chain, texel (x, y) of
+ * level l is at buf[get_offs(x, y, l)], or in the BC1 block that starts
+ * there. A BC1 block takes two words: RGB565 ends c0 > c1 in the low and
+ * high halves, then 2-bit palette indices of texels in row order */
+struct Texture {
+	using Color = PpmImg::Color;
+	static constexpr uint32_t BLOCK_SIZE = 4;
+	static constexpr uint32_t BLOCK_SHIFT = 2;
+	static constexpr uint32_t MAX_LEVELS = 16;
+
+	TexLayout layout = TexLayout::LINEAR;
+	uint32_t w = 0, h = 0;
+	uint32_t n_levels = 0;
+	/* Per level, int32_t for SIMD gathers */
+	int32_t lvl_w[MAX_LEVELS];
+	int32_t lvl_h[MAX_LEVELS];
+	int32_t lvl_pitch[MAX_LEVELS];	/* texels or blocks per row */
+	int32_t lvl_offs[MAX_LEVELS];
+	float   lvl_scale_x[MAX_LEVELS];	/* lvl_w / w */
+	float   lvl_scale_y[MAX_LEVELS];
+	std::vector<Color> buf;
+
+	/* Box filtered levels down to 1x1 if mipmaps is set */
+	void Import(PpmImg const &img, TexLayout layout_, bool mipmaps);
+	/* Levels of lvl_size {w, h} already laid out in texels, as an
+	 * Import left them in buf. false if the sizes don't add up */
+	bool Assign(TexLayout layout_, uint32_t w_, uint32_t h_,
+		    uint32_t n_levels_, uint32_t const (*lvl_size)[2],
+		    Color const *texels, std::size_t n_texels);
+
+	uint32_t get_offs(uint32_t x, uint32_t y, uint32_t l = 0) const
+	{
+		uint32_t offs = lvl_offs[l];
+		if (layout == TexLayout::LINEAR)
+			return offs + x + y * lvl_pitch[l];
+		uint32_t const mask = BLOCK_SIZE - 1;
+		uint32_t block = (x >> BLOCK_SHIFT) +
+				 (y >> BLOCK_SHIFT) * lvl_pitch[l];
+		if (layout == TexLayout::BC1)
+			return offs + block * 2;
+		return offs + (block << (2 * BLOCK_SHIFT)) +
+		       ((y & mask) << BLOCK_SHIFT) + (x & mask);
+	}
+
+	Color get(uint32_t x, uint32_t y, uint32_t l = 0) const
+	{
+		if (layout != TexLayout::BC1)
+			return buf[get_offs(x, y, l)];
+		uint32_t block[2];
+		memcpy(block, &buf[get_offs(x, y, l)], sizeof(block));
+		uint32_t const mask = BLOCK_SIZE - 1;
+		return Bc1Color(block[0], block[1],
+			((y & mask) << BLOCK_SHIFT) + (x & mask));
+	}
+
+	static Color Rgb565(uint32_t c)
+	{
+		uint32_t r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+		return Color { uint8_t((b << 3) | (b >> 2)),
+			       uint8_t((g << 2) | (g >> 4)),
+			       uint8_t((r << 3) | (r >> 2)), 255 };
+	}
+
+	/* Index i of bits selects c0, c1, (2 c0 + c1) / 3, (c0 + 2 c1) / 3 */
+	static Color Bc1Color(uint32_t ends, uint32_t bits, uint32_t i)
+	{
+		uint32_t const sel = (bits >> (2 * i)) & 3;
+		uint32_t const w1 = (BC1_W1 >> (2 * sel)) & 3;
+		Color c0 = Rgb565(ends & 0xffff), c1 = Rgb565(ends >> 16);
+		auto mix = [&](uint8_t a, uint8_t b) {
+			return uint8_t((a * (3 - w1) + b * w1) / 3);
+		};
+		return Color { mix(c0.b, c1.b), mix(c0.g, c1.g),
+			       mix(c0.r, c1.r), 255 };
+	}
+	/* Thirds of c1 per palette index, 2 bits each */
+	static constexpr uint32_t BC1_W1 = (2 << 6) | (1 << 4) | (3 << 2);
+
+private:
+	/* Returns buf words of the level, buf is not resized */
+	uint32_t AddLevelTable(uint32_t lw, uint32_t lh);
+	void AddLevel(Color const *src, uint32_t lw, uint32_t lh);
+	static void EncodeBc1(Color const (&texels)[16], Color (&block)[2]);
+};
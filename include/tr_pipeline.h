@@ -4,6 +4,7 @@
 
 #include <include/pipeline.h>
 #include <include/shaders.h>
+#include <include/simd.h>
 
 using TrPrim = std::array<Vertex, 3>;
 using TrData = std::array<ModelShader::VsOut, 3>;
@@ -29,11 +30,30 @@ enum class TrSetupCullingType {
 	FRONT,
 };
 
+enum class TrCoarseRastHizType {
+	DISABLED,
+	ACTIVE,	/* only with TrFineRastZbufType::ACTIVE, asserted by Pipeline */
+};
+
 enum class TrFineRastZbufType {
 	DISABLED,
 	ACTIVE,
 };
 
+enum class TrFineRastSimdType {
+	SCALAR,
+	AVX2,	/* 8 pixels of a tile row */
+	AVX512,	/* 16 pixels of a tile row */
+};
+
+#if defined(SIMD_AVX512)
+TrFineRastSimdType constexpr TrFineRastSimdDefault = TrFineRastSimdType::AVX512;
+#elif defined(SIMD_AVX2)
+TrFineRastSimdType constexpr TrFineRastSimdDefault = TrFineRastSimdType::AVX2;
+#else
+TrFineRastSimdType constexpr TrFineRastSimdDefault = TrFineRastSimdType::SCALAR;
+#endif
+
 enum class TrInterpType {
 	ALL,
 	TEXTURE,
@@ -41,6 +61,8 @@ enum class TrInterpType {
 };
 
 float constexpr TrFreeDepth = std::numeric_limits<float>::min();
+/* Fine buffer pixel not written in this tile */
+uint32_t constexpr TrNoDataId = std::numeric_limits<uint32_t>::max();
 
 template <TrSetupCullingType _type, typename _shader>
 struct TrSetup : public Setup<TrPrim, TrData, _shader> {
@@ -48,13 +70,36 @@ struct TrSetup : public Setup<TrPrim, TrData, _shader> {
 	using In      = typename Base::In;
 	using Data    = typename Base::Data;
 	using _Shader = typename Base::_Shader;
-	void Process(In const &in, std::vector<Data> &out) const override
+	using VsOut   = typename Base::VsOut;
+	uint32_t Process(In const &in, Data *out) const override
 	{
-		Data data;
-		for (int i = 0; i < in.size(); ++i) {
+		Data &data = *out;
+		for (int i = 0; i < in.size(); ++i)
 			data[i] = Base::shader.VShader(in[i]);
+		return Assemble(data);
+	}
+
+	uint32_t ProcessShaded(VsOut const *vtx, uint32_t const *ind,
+			Data *out) const override
+	{
+		Data &data = *out;
+		for (int i = 0; i < 3; ++i)
+			data[i] = vtx[ind[i]];
+		return Assemble(data);
+	}
+
+	void set_window(Window const &wnd) override
+	{
+		/* Nothing */
+	}
+
+private:
+	/* Clipping and culling of shaded triangle */
+	uint32_t Assemble(Data &data) const
+	{
+		for (int i = 0; i < 3; ++i) {
 			if (data[i].pos.w >= 0)
-				return;
+				return 0;
 		}
 		Vec3 tr[3] = { ReinterpVec3(data[0].pos),
 			       ReinterpVec3(data[1].pos),
@@ -68,10 +113,10 @@ struct TrSetup : public Setup<TrPrim, TrData, _shader> {
 		float det = d1.x * d2.y - d1.y * d2.x;
 		if (_type == decltype(_type)::BACK) {
 			if (det >= 0)
-				return;
+				return 0;
 		} else if (_type == decltype(_type)::FRONT) {
 			if (det <= 0)
-				return;
+				return 0;
 			auto tmp = data[0];
 			data[0] = data[2];
 			data[2] = tmp;
@@ -82,12 +127,7 @@ struct TrSetup : public Setup<TrPrim, TrData, _shader> {
 				data[2] = tmp;
 			}
 		}
-		out.push_back(data);
-	}
-
-	void set_window(Window const &wnd) override
-	{
-		/* Nothing */
+		return 1;
 	}
 };
 
@@ -123,14 +163,24 @@ inline void ClipBounds(Vec2i &min_r, Vec2i &max_r,
 	max_r.y = std::max(std::min(int32_t(max_r.y), int32_t(wnd_max.y)), 0);
 }
 
-struct TrEdgeEqn {
+/* Fixed-point edge functions: vertices snapped to 1/256 pixel, samples
+ * at integer pixels, F(px, py) = a * px + b * py + c >= 0 inside.
+ * Edges that are not top or left are biased by one sub-pixel unit, so a
+ * sample on an edge shared by two triangles belongs to exactly one.
+ * An edge with an end out of the guard band is taken from the unsnapped
+ * line instead, scaled down to keep a and b in 31 bits. It still gets
+ * exactly negated a, b, c in the triangle across, so the ownership rule
+ * holds for it too */
+struct TrEdgeEqnFx {
+	using Val = int64_t;
+	static constexpr int sub_bits = 8;
+	/* Snapped vertex range in pixels, keeps c in int64 */
+	static constexpr float guard = float(1 << 22);
+
 	struct Edge {
-		float cx, cy, c0;
-		float rej_mult;
+		int64_t a, b, c;
 	} edge[3];
 
-	/* Evaluate edge-func in left-bottom corner */
-
 	void set(Vec3 const (&v)[3])
 	{
 		set_edge(edge[0], v[0], v[1]);
@@ -138,71 +188,173 @@ struct TrEdgeEqn {
 		set_edge(edge[2], v[2], v[0]);
 	}
 
-  	void get_reject(float chunk_sz, float (&arr)[3]) const
+	int64_t eval(int i, int32_t px, int32_t py) const
+	{
+		Edge const &e = edge[i];
+		return e.a * px + e.b * py + e.c;
+	}
+
+	/* Offsets from chunk origin to max/min over its samples */
+	void get_reject(int32_t chunk_sz, int64_t (&arr)[3]) const
 	{
 		for (int i = 0; i < 3; ++i) {
 			Edge const &e = edge[i];
-			float mult = (e.cx + e.cy + e.rej_mult);
-			arr[i] = e.c0 + mult * (chunk_sz / 2);
+			arr[i] = (std::max<int64_t>(e.a, 0) +
+				  std::max<int64_t>(e.b, 0)) * (chunk_sz - 1);
 		}
 	}
 
-	bool try_reject(Vec2i const &v, float const (&arr)[3]) const
+	bool try_reject(Vec2i const &v, int64_t const (&arr)[3]) const
 	{
 		for (int i = 0; i < 3; ++i) {
-			Edge const &e = edge[i];
-			float val = e.cx * float(v.x)
-				+ e.cy * float(v.y) + arr[i]; // 0.5?
-
-			if (val >= 0)
+			if (eval(i, v.x, v.y) + arr[i] < 0)
 				return true;
 		}
 		return false;
 	}
 
-  	void get_accept(float chunk_sz, float (&arr)[3]) const
+	void get_accept(int32_t chunk_sz, int64_t (&arr)[3]) const
 	{
 		for (int i = 0; i < 3; ++i) {
 			Edge const &e = edge[i];
-			float mult = (e.cx + e.cy - e.rej_mult);
-			arr[i] = e.c0 + mult * (chunk_sz / 2);
+			arr[i] = (std::min<int64_t>(e.a, 0) +
+				  std::min<int64_t>(e.b, 0)) * (chunk_sz - 1);
 		}
 	}
 
-	bool try_accept(Vec2i const &v, float const (&arr)[3]) const
+	bool try_accept(Vec2i const &v, int64_t const (&arr)[3]) const
 	{
 		for (int i = 0; i < 3; ++i) {
-			Edge const &e = edge[i];
-			float val = e.cx * float(v.x)
-				+ e.cy * float(v.y) + arr[i]; // 0.5?
-
-			if (val >= 0)
+			if (eval(i, v.x, v.y) + arr[i] < 0)
 				return false;
 		}
 		return true;
 	}
 private:
-	void set_edge(Edge &e, Vec3 const &v0, Vec3 const &v1)
+	static bool in_guard(Vec3 const &v)
 	{
-		e.cx = v0.y - v1.y;
-		e.cy = v1.x - v0.x;
-		e.c0 = v0.x * v1.y - v0.y * v1.x;
-		upd_rej_mult(e);
+		return std::fabs(v.x) < guard && std::fabs(v.y) < guard;
 	}
 
-	void upd_rej_mult(Edge &e) // from chunk center
+	static bool top_left(Edge const &e)
 	{
-		if (e.cx < 0) // right
-			e.rej_mult  =  e.cx;
-		else
-			e.rej_mult  = -e.cx;
-		if (e.cy < 0) // up
-			e.rej_mult +=  e.cy;
-		else
-			e.rej_mult += -e.cy;
+		return e.a > 0 || (e.a == 0 && e.b > 0);
+	}
+
+	static void set_edge(Edge &e, Vec3 const &v0, Vec3 const &v1)
+	{
+		if (!in_guard(v0) || !in_guard(v1)) {
+			set_edge_wide(e, v0, v1);
+			return;
+		}
+		int64_t const x0 = std::lrint(v0.x * (1 << sub_bits));
+		int64_t const y0 = std::lrint(v0.y * (1 << sub_bits));
+		int64_t const x1 = std::lrint(v1.x * (1 << sub_bits));
+		int64_t const y1 = std::lrint(v1.y * (1 << sub_bits));
+		e.a = y1 - y0;
+		e.b = x0 - x1;
+		int64_t c = y0 * x1 - x0 * y1;
+		if (!top_left(e))
+			c -= 1;
+		/* Samples are on multiples of 1 << sub_bits, so the sign of
+		 * F is kept by flooring c */
+		e.c = c >> sub_bits;
+	}
+
+	/* Products of float coordinates are exact in double, the rest
+	 * rounds the same for both orders of the ends up to the sign */
+	static void set_edge_wide(Edge &e, Vec3 const &v0, Vec3 const &v1)
+	{
+		double const s = 1 << sub_bits;
+		double const x0 = v0.x * s, y0 = v0.y * s;
+		double const x1 = v1.x * s, y1 = v1.y * s;
+		double a = y1 - y0;
+		double b = x0 - x1;
+		double c = (y0 * x1 - x0 * y1) / s;
+		if (!std::isfinite(a) || !std::isfinite(b) ||
+		    !std::isfinite(c)) {
+			e = Edge{ 0, 0, -1 }; /* covers nothing */
+			return;
+		}
+		int exp;
+		std::frexp(std::max(std::fabs(a), std::fabs(b)), &exp);
+		double const scale = std::ldexp(1, 30 - exp);
+		e.a = std::llrint(a * scale);
+		e.b = std::llrint(b * scale);
+		/* Far lines keep their sign over any window */
+		double const lim = std::ldexp(1, 60);
+		c = std::max(-lim, std::min(lim, c * scale));
+		e.c = top_left(e) ? int64_t(std::floor(c)) :
+				    int64_t(std::ceil(c)) - 1;
+	}
+};
+
+/* Tile-relative fixed-point edges. Origin values are saturated, which
+ * still gives the right sign over the tile while the steps are narrow,
+ * wider edges are evaluated in int64 per sample */
+struct TrFineEdges {
+	int32_t o[3], a[3], b[3];
+	bool narrow;
+	TrEdgeEqnFx const *eqn;
+	Vec2i r0;
+
+	void set(TrEdgeEqnFx const &eqn_, Vec2i const &r0_)
+	{
+		int64_t const lim = int64_t(1) << 30;
+		int64_t const step_lim = int64_t(1) << 24;
+		eqn = &eqn_;
+		r0 = r0_;
+		narrow = true;
+		for (int i = 0; i < 3; ++i) {
+			int64_t v = eqn->eval(i, r0.x, r0.y);
+			int64_t const ea = eqn->edge[i].a;
+			int64_t const eb = eqn->edge[i].b;
+			narrow &= std::abs(ea) < step_lim &&
+				  std::abs(eb) < step_lim;
+			o[i] = std::max(-lim, std::min(lim, v));
+			a[i] = int32_t(ea);
+			b[i] = int32_t(eb);
+		}
+	}
+
+	bool inside(int32_t x, int32_t y) const
+	{
+		if (!narrow) {
+			for (int i = 0; i < 3; ++i)
+				if (eqn->eval(i, r0.x + x, r0.y + y) < 0)
+					return false;
+			return true;
+		}
+		int32_t v = 0;
+		for (int i = 0; i < 3; ++i)
+			v |= o[i] + a[i] * x + b[i] * y;
+		return v >= 0;
 	}
 };
 
+/* Calls visit(x, y, accepted) for chunks in [min_r, max_r] that are not
+ * rejected, chunk origin is ((base + x) * chunk_sz, (base + y) * chunk_sz) */
+template <typename _eqn, typename _visit>
+inline void TrTraverseChunks(_eqn const &eqn, int32_t chunk_sz,
+	Vec2i const &base, Vec2i const &min_r, Vec2i const &max_r,
+	_visit &&visit)
+{
+	typename _eqn::Val rej[3];
+	typename _eqn::Val acc[3];
+	eqn.get_reject(chunk_sz, rej);
+	eqn.get_accept(chunk_sz, acc);
+
+	for (int32_t y = min_r.y; y <= max_r.y; ++y) {
+		for (int32_t x = min_r.x; x <= max_r.x; ++x) {
+			Vec2i vec {(base.x + x) * chunk_sz,
+				   (base.y + y) * chunk_sz};
+			if (eqn.try_reject(vec, rej))
+				continue;
+			visit(x, y, eqn.try_accept(vec, acc));
+		}
+	}
+}
+
 struct TrBinRast final : public BinRast<TrData, TrOverlapInfo> {
 	int32_t w_bins, h_bins;
 	void set_window(Window const &wnd) override
@@ -230,29 +382,33 @@ struct TrBinRast final : public BinRast<TrData, TrOverlapInfo> {
 		Vec3 tr_vec[3] = { ReinterpVec3(data[0].pos),
 				   ReinterpVec3(data[1].pos),
 				   ReinterpVec3(data[2].pos) };
-		TrEdgeEqn eqn;
-		float rej[3];
-		float acc[3];
-
-		eqn.set(tr_vec);
-		eqn.get_reject(float(BIN_PIX), rej);
-		eqn.get_accept(float(BIN_PIX), acc);
 
 		Out out = {.id = id};
-		for (uint32_t y = min_r.y; y <= max_r.y; ++y) {
-			for (uint32_t x = min_r.x; x <= max_r.x; ++x) {
-				Vec2i vec {int32_t(x * BIN_PIX),
-					   int32_t(y * BIN_PIX)};
-				if (eqn.try_reject(vec, rej))
-					continue;
-				out.accepted = eqn.try_accept(vec, acc);
-				buf[x + y * w_bins].push_back(out);
-			}
-		}
+		auto visit = [&](int32_t x, int32_t y, bool accepted) {
+			out.accepted = accepted;
+			buf[x + y * w_bins].push_back(out);
+		};
+		TrEdgeEqnFx eqn;
+		eqn.set(tr_vec);
+		TrTraverseChunks(eqn, BIN_PIX, Vec2i{0, 0},
+				 min_r, max_r, visit);
 	}
 };
 
-struct TrCoarseRast final : public CoarseRast<TrData, TrOverlapInfo, TrOverlapInfo> {
+/* Hierarchical-Z over one bin: lower bound of the depth already in each
+ * tile, raised by triangles fully covering the tile in submission order,
+ * and its minimum over the bin. A triangle with all of its depth below
+ * it fails the depth test everywhere and never reaches fine rast */
+struct TrHizState {
+	Bin<float> tile;
+	float bin;
+};
+
+template <TrCoarseRastHizType _type>
+struct TrCoarseRast final :
+	public CoarseRast<TrData, TrOverlapInfo, TrOverlapInfo, TrHizState> {
+	static constexpr bool reads_depth =
+		_type == TrCoarseRastHizType::ACTIVE;
 	int32_t w_tiles, h_tiles;
 	void set_window(Window const &wnd) override
 	{
@@ -260,17 +416,91 @@ struct TrCoarseRast final : public CoarseRast<TrData, TrOverlapInfo, TrOverlapIn
 		h_tiles = DivRoundUp(wnd.h, TILE_SIZE);
 	}
 
+	void ClearState(State &state, Vec2i const &bin, uint32_t tile_beg,
+			uint32_t tile_end, DepthTarget const *depth) const override
+	{
+		if (_type == decltype(_type)::DISABLED)
+			return;
+		/* Tiles out of window or of this task are never drawn, don't
+		 * let them hold the bin level down. Depth of the latter is
+		 * committed by sibling tasks meanwhile, so it's not read */
+		for (int32_t y = 0; y < BIN_SIZE; ++y) {
+			for (int32_t x = 0; x < BIN_SIZE; ++x) {
+				Vec2i tile {bin.x * BIN_SIZE + x,
+					    bin.y * BIN_SIZE + y};
+				uint32_t const id = x + y * BIN_SIZE;
+				float &val = state.tile[id];
+				if (tile.x >= w_tiles || tile.y >= h_tiles ||
+				    id < tile_beg || id >= tile_end)
+					val = std::numeric_limits<float>::max();
+				else if (!depth || !depth->get_min(
+					 depth->get_tile_id(tile), val))
+					val = TrFreeDepth;
+			}
+		}
+		state.bin = *std::min_element(state.tile.begin(),
+					      state.tile.end());
+	}
+
 	void Process(std::vector<Data> const &data_buf, In in,
-		Bin<std::vector<Out>> &buf, Vec2i const &bin) const override
+		Bin<std::vector<Out>> &buf, State &state,
+		Vec2i const &bin) const override
 	{
+		auto const &data = data_buf[in.id];
+		float z_min = std::min(data[0].pos.z,
+				std::min(data[1].pos.z, data[2].pos.z));
+		float z_max = std::max(data[0].pos.z,
+				std::max(data[1].pos.z, data[2].pos.z));
+		Hiz hiz {state, z_max, OccluderDepth(z_min), false};
+		if (hiz.enabled() && z_max < state.bin)
+			return;
+
 		if (in.accepted)
-			ProcessAccepted(in, buf, bin);
+			ProcessAccepted(in, buf, bin, hiz);
 		else
-			ProcessOverlapped(data_buf, in, buf, bin);
+			ProcessOverlapped(data_buf, in, buf, bin, hiz);
+
+		if (hiz.updated)
+			state.bin = *std::min_element(state.tile.begin(),
+						      state.tile.end());
 	}
 
 private:
-	void ProcessAccepted(In in, Bin<std::vector<Out>> &buf, Vec2i const &bin) const
+	struct Hiz {
+		State &state;
+		float z_max;
+		float z_occl;
+		bool updated;
+
+		static constexpr bool enabled()
+		{
+			return _type == decltype(_type)::ACTIVE;
+		}
+
+		/* false -> tile is occluded */
+		bool visit(uint32_t tile_id, bool accepted)
+		{
+			if (!enabled())
+				return true;
+			float &tile = state.tile[tile_id];
+			if (z_max < tile)
+				return false;
+			if (accepted && z_occl > tile) {
+				tile = z_occl;
+				updated = true;
+			}
+			return true;
+		}
+	};
+
+	/* Depth interpolated in fine rast may go slightly below vertices */
+	static float OccluderDepth(float z_min)
+	{
+		return z_min - std::fabs(z_min) * (1.0f / (1 << 16));
+	}
+
+	void ProcessAccepted(In in, Bin<std::vector<Out>> &buf,
+		Vec2i const &bin, Hiz &hiz) const
 	{
 		Vec2i min_r {bin.x * BIN_SIZE,
 			     bin.y * BIN_SIZE};
@@ -287,14 +517,17 @@ private:
 		max_r.y = max_r.y % BIN_SIZE;
 
 		for (uint32_t y = 0; y <= max_r.y; ++y) {
-			for (uint32_t x = 0; x <= max_r.x; ++x)
-				buf[x + y * BIN_SIZE].push_back(in);
+			for (uint32_t x = 0; x <= max_r.x; ++x) {
+				uint32_t tile_id = x + y * BIN_SIZE;
+				if (hiz.visit(tile_id, true))
+					buf[tile_id].push_back(in);
+			}
 		}
 	}
 
 	// bin -> crd
 	void ProcessOverlapped(std::vector<Data> const &data_buf, In in,
-		Bin<std::vector<Out>> &buf, Vec2i const &bin) const
+		Bin<std::vector<Out>> &buf, Vec2i const &bin, Hiz &hiz) const
 	{
 		auto const &data = data_buf[in.id];
 		Vec2i min_r, max_r;
@@ -321,45 +554,52 @@ private:
 		Vec3 tr_vec[3] = { ReinterpVec3(data[0].pos),
 				   ReinterpVec3(data[1].pos),
 				   ReinterpVec3(data[2].pos) };
-		TrEdgeEqn eqn;
-		float rej[3];
-		float acc[3];
+		Vec2i base {bin.x * BIN_SIZE, bin.y * BIN_SIZE};
 
+		auto visit = [&](int32_t x, int32_t y, bool accepted) {
+			uint32_t tile_id = x + y * BIN_SIZE;
+			if (!hiz.visit(tile_id, accepted))
+				return;
+			in.accepted = accepted;
+			buf[tile_id].push_back(in);
+		};
+		TrEdgeEqnFx eqn;
 		eqn.set(tr_vec);
-		eqn.get_reject(float(TILE_SIZE), rej);
-		eqn.get_accept(float(TILE_SIZE), acc);
-
-		for (uint32_t y = min_r.y; y <= max_r.y; ++y) {
-			for (uint32_t x = min_r.x; x <= max_r.x; ++x) {
-				Vec2i vec {(bin.x * BIN_SIZE + int32_t(x))
-					   * TILE_SIZE,
-					   (bin.y * BIN_SIZE + int32_t(y))
-				           * TILE_SIZE};
-				if (eqn.try_reject(vec, rej))
-					continue;
-				in.accepted = eqn.try_accept(vec, acc);
-				buf[x + y * BIN_SIZE].push_back(in);
-			}
-		}
+		TrTraverseChunks(eqn, TILE_SIZE, base, min_r, max_r, visit);
 	}
 };
 
-template <TrFineRastZbufType _type>
+template <TrFineRastZbufType _type,
+	  TrFineRastSimdType _simd = TrFineRastSimdDefault>
 struct TrFineRast : public FineRast<TrData, TrOverlapInfo, TrFragm> {
+	static constexpr bool writes_depth =
+		_type == TrFineRastZbufType::ACTIVE;
 	void set_window(Window const &wnd) override
 	{
 
 	}
 
-	void ClearBuf(Tile<Out> &buf) const override
+	void ClearBuf(Tile<Out> &buf, float const *depth) const override
+	{
+		for (uint32_t i = 0; i < buf.size(); ++i) {
+			buf[i].fragm.depth = depth ? depth[i] : TrFreeDepth;
+			buf[i].data_id = TrNoDataId;
+		}
+	}
+
+	float StoreDepth(Tile<Out> const &buf, float *depth) const override
 	{
-		for (auto &out : buf)
-			out.fragm.depth = TrFreeDepth;
+		float min = std::numeric_limits<float>::max();
+		for (uint32_t i = 0; i < buf.size(); ++i) {
+			depth[i] = buf[i].fragm.depth;
+			min = std::min(min, depth[i]);
+		}
+		return min;
 	}
 
-	bool Check(Fragm const &fragm) const override
+	bool Check(Out const &out) const override
 	{
-		return fragm.depth != TrFreeDepth;
+		return out.data_id != TrNoDataId;
 	}
 
 	bool Process(std::vector<TrData> const &data_buf, In in,
@@ -419,21 +659,25 @@ struct TrFineRast : public FineRast<TrData, TrOverlapInfo, TrFragm> {
 		max_r.x = max_r.x % TILE_SIZE;
 		max_r.y = max_r.y % TILE_SIZE;
 
+		/* Coverage from fixed-point edges, barycentrics stay float */
+		TrEdgeEqnFx eqn;
+		eqn.set(tr);
+		TrFineEdges edges;
+		edges.set(eqn, Vec2i{crd.x * TILE_SIZE, crd.y * TILE_SIZE});
 		ProcessOverlapped(min_r, max_r, pack_0,
-				pack_dx, pack_dy, buf, in.id);
+				pack_dx, pack_dy, buf, in.id, &edges);
 		return false;
 	}
 
 private:
 	inline void ProcessOverlapped(Vec2i const &min_r, Vec2i const &max_r,
 		Vec4 pack_0, Vec4 const &pack_dx, Vec4 const &pack_dy,
-		Tile<Out> &buf, uint32_t id) const
+		Tile<Out> &buf, uint32_t id, TrFineEdges const *fx) const
 	{
 #define _process_zbuf					\
 do {							\
 	float depth = (buf[pix_ind].fragm.depth);	\
-	if (pack[0] >= 0 && pack[1] >= 0 &&		\
-	    pack[2] >= 0 && pack[3] >= depth) {		\
+	if (inside && pack[3] >= depth) {		\
 		out.fragm.sse_data = pack;		\
 		out.data_id = id;			\
 		buf[pix_ind] = out;			\
@@ -442,19 +686,35 @@ do {							\
 
 #define _process_no_zbuf				\
 do {							\
-	if (pack[0] >= 0 && pack[1] >= 0 &&		\
-	    pack[2] >= 0 && pack[3] >=			\
+	if (inside && pack[3] >=			\
 	    std::numeric_limits<float>::min()) {	\
 		out.fragm.sse_data = pack;		\
 		out.data_id = id;			\
 		buf[pix_ind] = out;			\
 	}						\
 } while (0)
+#ifdef SIMD_AVX512
+		if constexpr (_simd == TrFineRastSimdType::AVX512 &&
+			      TILE_SIZE % Simd16::width == 0) {
+			ProcessSimd<Simd16, false>(min_r, max_r, pack_0,
+					pack_dx, pack_dy, buf, id, fx);
+			return;
+		}
+#endif
+#ifdef SIMD_AVX2
+		if constexpr (_simd != TrFineRastSimdType::SCALAR &&
+			      TILE_SIZE % Simd8::width == 0) {
+			ProcessSimd<Simd8, false>(min_r, max_r, pack_0,
+					pack_dx, pack_dy, buf, id, fx);
+			return;
+		}
+#endif
 		Out out;
 		for (uint32_t y = min_r.y; y <= max_r.y; ++y) {
 			Vec4 pack = pack_0;
 			for (uint32_t x = min_r.x; x <= max_r.x; ++x) {
 				uint32_t pix_ind = x + y * TILE_SIZE;
+				bool inside = fx->inside(x, y);
 				if (_type == decltype(_type)::ACTIVE) {
 					_process_zbuf;
 				} else {
@@ -487,6 +747,24 @@ do {					\
 	out.data_id = id;		\
 	buf[pix_ind] = out;		\
 } while (0)
+		Vec2i const min_r = { 0, 0 };
+		Vec2i const max_r = { TILE_SIZE - 1, TILE_SIZE - 1 };
+#ifdef SIMD_AVX512
+		if constexpr (_simd == TrFineRastSimdType::AVX512 &&
+			      TILE_SIZE % Simd16::width == 0) {
+			ProcessSimd<Simd16, true>(min_r, max_r, pack_0,
+					pack_dx, pack_dy, buf, id, nullptr);
+			return;
+		}
+#endif
+#ifdef SIMD_AVX2
+		if constexpr (_simd != TrFineRastSimdType::SCALAR &&
+			      TILE_SIZE % Simd8::width == 0) {
+			ProcessSimd<Simd8, true>(min_r, max_r, pack_0,
+					pack_dx, pack_dy, buf, id, nullptr);
+			return;
+		}
+#endif
 		Out out;
 		for (uint32_t y = 0; y < TILE_SIZE; ++y) {
 			Vec4 pack = pack_0;
@@ -504,6 +782,98 @@ do {					\
 #undef _process_zbuf
 #undef _process_no_zbuf
 	}
+
+	/* Edge test, depth test and store of S::width pixels at once,
+	 * pack_0 is taken at min_r */
+	template <typename S, bool _accepted>
+	inline void ProcessSimd(Vec2i const &min_r, Vec2i const &max_r,
+		Vec4 const &pack_0, Vec4 const &pack_dx, Vec4 const &pack_dy,
+		Tile<Out> &buf, uint32_t id, TrFineEdges const *fx) const
+	{
+		using F = typename S::F;
+		using I = typename S::I;
+		int const W = S::width;
+		int32_t const stride = sizeof(Out) / sizeof(float);
+
+		F row[4], step_x[4], step_y[4];
+		for (int k = 0; k < 4; ++k) {
+			step_x[k] = S::set1(W * pack_dx[k]);
+			step_y[k] = S::set1(pack_dy[k]);
+			/* Value at lane of x = 0 chunk */
+			F lane_x = S::sub(S::lanes(), S::set1(float(min_r.x)));
+			row[k] = S::fmadd(lane_x, S::set1(pack_dx[k]),
+					  S::set1(pack_0[k]));
+		}
+		F const free_depth = S::set1(TrFreeDepth);
+
+		I edge_x[3];
+		if (!_accepted && fx->narrow) {
+			for (int k = 0; k < 3; ++k)
+				edge_x[k] = S::muli(S::lanesi(),
+						    S::seti(fx->a[k]));
+		}
+
+		int32_t const cx_beg = min_r.x - min_r.x % W;
+		for (int32_t y = min_r.y; y <= max_r.y; ++y) {
+			F v[4];
+			for (int k = 0; k < 4; ++k)
+				v[k] = S::fmadd(S::set1(float(cx_beg / W)),
+						step_x[k], row[k]);
+
+			for (int32_t cx = cx_beg; cx <= max_r.x; cx += W) {
+				Out *dst = &buf[cx + y * TILE_SIZE];
+				typename S::Mask mask = S::full;
+				if (!_accepted) {
+					if (cx < min_r.x)
+						mask &= S::full << (min_r.x - cx);
+					if (cx + W - 1 > max_r.x)
+						mask &= S::full >>
+							(cx + W - 1 - max_r.x);
+					if (fx->narrow) {
+						I e = S::seti(0);
+						for (int k = 0; k < 3; ++k)
+							e = S::ori(e, S::addi(
+								edge_x[k], S::seti(
+								fx->o[k] +
+								fx->a[k] * cx +
+								fx->b[k] * y)));
+						mask &= ~S::negi(e);
+					} else {
+						for (int i = 0; i < W; ++i) {
+							if (!fx->inside(cx + i,
+									y))
+								mask &= ~(1u << i);
+						}
+					}
+				}
+				if (_type == decltype(_type)::ACTIVE) {
+					F depth = S::gather(
+						&dst->fragm.depth, stride);
+					mask &= S::ge(v[3], depth);
+				} else if (!_accepted) {
+					mask &= S::ge(v[3], free_depth);
+				}
+
+				if (mask) {
+					alignas(64) float aos[4 * W];
+					S::Transpose4(v, aos);
+					while (mask) {
+						int i = __builtin_ctz(mask);
+						mask &= mask - 1;
+						float const *src =
+							aos + 4 * S::AosSlot(i);
+						dst[i].fragm.sse_data.ymm =
+							_mm_load_ps(src);
+						dst[i].data_id = id;
+					}
+				}
+				for (int k = 0; k < 4; ++k)
+					v[k] = S::add(v[k], step_x[k]);
+			}
+			for (int k = 0; k < 4; ++k)
+				row[k] = S::add(row[k], step_y[k]);
+		}
+	}
 };
 
 template<TrInterpType _type>
@@ -554,4 +924,133 @@ struct TrInterp: public Interp<TrData, TrFragm, Vertex> {
 			v.norm = Normalize(v.norm);
 		return v;
 	}
+
+#ifdef SIMD_PACK
+	void ProcessPack(std::vector<Data> const &data_buf,
+		FineOut<Fragm> const *fragm, PackMask mask,
+		OutPack &out) const override
+	{
+		using S = SimdPack;
+		using F = S::F;
+		using I = S::I;
+		using VsOut = ModelShader::VsOut;
+		int32_t const stride = sizeof(*fragm) / sizeof(float);
+		/* Offsets in floats, ids up to 2^31 / data_sz */
+		int32_t const data_sz = sizeof(Data) / sizeof(float);
+		int32_t const vtx_sz = sizeof(VsOut) / sizeof(float);
+		int32_t const pos_x = offsetof(VsOut, pos.x) / sizeof(float);
+		int32_t const pos_y = offsetof(VsOut, pos.y) / sizeof(float);
+		int32_t const pos_z = offsetof(VsOut, pos.z) / sizeof(float);
+		int32_t const fs_pos = offsetof(VsOut, fs_vtx.pos) / sizeof(float);
+		int32_t const fs_tex = offsetof(VsOut, fs_vtx.tex) / sizeof(float);
+		int32_t const fs_norm = offsetof(VsOut, fs_vtx.norm) / sizeof(float);
+
+		F bc[3];
+		for (int i = 0; i < 3; ++i)
+			bc[i] = S::gather(&fragm->fragm.bc[i], stride);
+
+		/* Lanes of a row chunk mostly come from one triangle */
+		float const *base =
+			reinterpret_cast<float const *>(data_buf.data());
+		I ids = S::gatheri(
+			reinterpret_cast<int32_t const *>(&fragm->data_id),
+			stride);
+		uint32_t id0 = fragm[__builtin_ctz(mask)].data_id;
+		bool uniform = (S::eqi(ids, S::seti(id0)) & mask) == mask;
+		I offs = S::muli(ids, S::seti(data_sz));
+		auto attr = [&](int vtx, int32_t off) -> F {
+			off += vtx * vtx_sz;
+			if (uniform)
+				return S::set1(base[id0 * data_sz + off]);
+			return S::gather(base, S::addi(offs, S::seti(off)),
+					 mask);
+		};
+
+		F mp = S::set1(1);
+#ifndef HACK_TRINTERP_LINEAR
+		mp = S::set1(0);
+		for (int i = 0; i < 3; ++i) {
+			bc[i] = S::div(bc[i], attr(i, pos_z));
+			mp = S::add(mp, bc[i]);
+		}
+		for (int i = 0; i < 3; ++i)
+			bc[i] = S::div(bc[i], mp);
+#endif
+
+		auto interp = [&](int32_t off) -> F {
+			F v = S::mul(bc[0], attr(0, off));
+			v = S::fmadd(bc[1], attr(1, off), v);
+			return S::fmadd(bc[2], attr(2, off), v);
+		};
+
+		if (_type == decltype(_type)::ALL ||
+		    _type == decltype(_type)::POS) {
+			for (int k = 0; k < 3; ++k)
+				out.pos[k] = interp(fs_pos + k);
+		}
+		if (_type == decltype(_type)::ALL ||
+		    _type == decltype(_type)::TEXTURE) {
+			for (int k = 0; k < 2; ++k)
+				out.tex[k] = interp(fs_tex + k);
+			if (derivs)
+				TexDerivs(attr, pos_x, pos_y, pos_z, fs_tex,
+					  mp, out);
+		}
+		if (_type == decltype(_type)::ALL) {
+			F len2 = S::set1(0);
+			for (int k = 0; k < 3; ++k) {
+				out.norm[k] = interp(fs_norm + k);
+				len2 = S::fmadd(out.norm[k], out.norm[k], len2);
+			}
+			F len = S::sqrt(len2);
+			for (int k = 0; k < 3; ++k)
+				out.norm[k] = S::div(out.norm[k], len);
+		}
+	}
+
+private:
+	/* d(tex)/dx, d(tex)/dy in pixels for mip selection, from the screen
+	 * space barycentric gradients of the triangle. With perspective
+	 * da = sum(dbc[i] * (a[i] - a) / z[i]) / mp */
+	template <typename _attr>
+	static void TexDerivs(_attr const &attr, int32_t pos_x, int32_t pos_y,
+		int32_t pos_z, int32_t fs_tex, SimdPack::F mp, OutPack &out)
+	{
+		using S = SimdPack;
+		using F = S::F;
+		F x[3], y[3], k[3];
+		for (int i = 0; i < 3; ++i) {
+			x[i] = attr(i, pos_x);
+			y[i] = attr(i, pos_y);
+#ifndef HACK_TRINTERP_LINEAR
+			k[i] = S::div(S::set1(1), S::mul(attr(i, pos_z), mp));
+#else
+			k[i] = mp;
+#endif
+		}
+		F e1x = S::sub(x[1], x[0]), e1y = S::sub(y[1], y[0]);
+		F e2x = S::sub(x[2], x[0]), e2y = S::sub(y[2], y[0]);
+		F inv_area = S::div(S::set1(1), S::sub(S::mul(e1x, e2y),
+							 S::mul(e1y, e2x)));
+		F dbdx[3], dbdy[3];
+		dbdx[1] = S::mul(e2y, inv_area);
+		dbdy[1] = S::sub(S::set1(0), S::mul(e2x, inv_area));
+		dbdx[2] = S::sub(S::set1(0), S::mul(e1y, inv_area));
+		dbdy[2] = S::mul(e1x, inv_area);
+		dbdx[0] = S::sub(S::set1(0), S::add(dbdx[1], dbdx[2]));
+		dbdy[0] = S::sub(S::set1(0), S::add(dbdy[1], dbdy[2]));
+
+		for (int c = 0; c < 2; ++c) {
+			F dx = S::set1(0), dy = S::set1(0);
+			for (int i = 0; i < 3; ++i) {
+				F d = S::mul(k[i], S::sub(attr(i, fs_tex + c),
+							  out.tex[c]));
+				dx = S::fmadd(dbdx[i], d, dx);
+				dy = S::fmadd(dbdy[i], d, dy);
+			}
+			out.tex_dx[c] = dx;
+			out.tex_dy[c] = dy;
+		}
+	}
+#endif
 };
@@ -5,12 +5,13 @@
 #include <string>
 #include <array>
 #include <include/geom.h>
-#include <include/ppm.h>
+#include <include/texture.h>
 
 struct Wfobj {
 	struct Mesh {
+		using Index = uint32_t;
 		std::vector<Vertex> verts;
-		std::vector<std::size_t> inds;
+		std::vector<Index> inds;
 	} mesh;
 
 	struct Mtl {
@@ -23,12 +24,42 @@ struct Wfobj {
 			float r, g, b;
 		} amb, diff, spec;
 		float ns;
-		PpmImg tex_img;
+		Texture tex;
 	} mtl;
 
 	std::string name;
 
-	void get_prim_buf(std::vector<std::array<Vertex, 3>> &);
+	void get_prim_buf(std::vector<std::array<Vertex, 3>> &) const;
 };
 
-int ImportWfobj(const char *obj_path, std::vector<Wfobj> &vec);
+/* Texel layout of the material textures, built at import */
+struct WfobjTexFormat {
+	TexLayout layout = TexLayout::LINEAR;
+	bool mipmaps = false;
+};
+
+/* Appends the objects to vec, loads them from obj_path + WFOBJ_CACHE_EXT
+ * if it is up to date with the obj, mtl and texture files and holds
+ * textures in tex_fmt, otherwise parses the sources and rewrites the
+ * cache. Meshes are cached in file order, passes like MeshOptimize run
+ * after every load */
+#define WFOBJ_CACHE_EXT ".wfcache"
+int ImportWfobj(const char *obj_path, std::vector<Wfobj> &vec,
+		WfobjTexFormat tex_fmt = {});
+
+/* Source file as it was when read, the cache is valid while it stays */
+struct WfobjCacheDep {
+	std::string path;
+	uint64_t size;
+	int64_t mtime_ns;
+};
+int StatWfobjCacheDep(char const *path, WfobjCacheDep &dep);
+
+/* Binary mesh + material + texture levels ready to sample, deps are
+ * stated before the sources are read so edits while parsing invalidate
+ * the cache. Load fails unless the textures are in tex_fmt */
+int LoadWfobjCache(char const *cache_path, std::vector<Wfobj> &vec,
+	WfobjTexFormat tex_fmt);
+int StoreWfobjCache(char const *cache_path, Wfobj const *objs,
+	std::size_t n_objs, std::vector<WfobjCacheDep> const &deps,
+	WfobjTexFormat tex_fmt);
@@ -8,13 +8,18 @@ extern "C" {
 };
 
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "include/fbuffer.h"
 
-int Fbuffer::Init(const char *path)
+int Fbuffer::Init(const char *path, FbPresentType present_)
 {
-	void *map_region;
-
 	fd = open(path, O_RDWR);
 	if (fd < 0)
 		goto handle_err_0;
@@ -25,27 +30,473 @@ int Fbuffer::Init(const char *path)
 	if (ioctl(fd, FBIOGET_FSCREENINFO, (fb_fix_screeninfo *)this) < 0)
 		goto handle_err_1;
 
-	// tmp for bigger tiles
-	buf = (Color*) malloc(sizeof(Color) * xres * yres * 1.5);
-	if (buf == NULL)
+	if (SetPixelFormat() < 0)
+		goto handle_err_1;
+
+	stride = xres;
+	present = present_;
+	if (InitBuffers() < 0)
+		goto handle_err_1;
+
+	return 0;
+
+handle_err_1:
+	close(fd);
+	fd = -1;
+handle_err_0:
+	return -1;
+}
+
+int Fbuffer::InitOffscreen(std::uint32_t w, std::uint32_t h,
+			   std::uint32_t stride_)
+{
+	if (stride_ == 0)
+		stride_ = w;
+	if (w == 0 || h == 0 || stride_ < w)
+		return -1;
+
+	SetGeometry(w, h, stride_, 8 * sizeof(Color));
+	fd = -1;
+	present = FbPresentType::SYNC;
+	SetPixelFormat();
+	return InitBuffers();
+}
+
+int Fbuffer::InitFile(const char *path, std::uint32_t w, std::uint32_t h,
+		      std::uint32_t stride_, FbPresentType present_,
+		      std::uint32_t bpp)
+{
+	if (stride_ == 0)
+		stride_ = w;
+	if (w == 0 || h == 0 || stride_ < w)
+		return -1;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		goto handle_err_0;
+
+	SetGeometry(w, h, stride_, bpp);
+	if (SetPixelFormat() < 0)
+		goto handle_err_1;
+	smem_len = line_length * h;
+	if (ftruncate(fd, smem_len) < 0)
+		goto handle_err_1;
+
+	present = present_;
+	if (InitBuffers() < 0)
 		goto handle_err_1;
 
 	return 0;
 
 handle_err_1:
 	close(fd);
+	fd = -1;
 handle_err_0:
 	return -1;
 }
 
+void Fbuffer::SetGeometry(std::uint32_t w, std::uint32_t h,
+			  std::uint32_t stride_, std::uint32_t bpp)
+{
+	memset((fb_var_screeninfo *)this, 0, sizeof(fb_var_screeninfo));
+	memset((fb_fix_screeninfo *)this, 0, sizeof(fb_fix_screeninfo));
+
+	xres = xres_virtual = w;
+	yres = yres_virtual = h;
+	bits_per_pixel = bpp;
+	if (bpp == 16) {
+		blue   = { .offset =  0, .length = 5 };
+		green  = { .offset =  5, .length = 6 };
+		red    = { .offset = 11, .length = 5 };
+	} else {
+		blue   = { .offset =  0, .length = 8 };
+		green  = { .offset =  8, .length = 8 };
+		red    = { .offset = 16, .length = 8 };
+		if (bpp == 32)
+			transp = { .offset = 24, .length = 8 };
+	}
+	line_length = stride_ * bpp / 8;
+	stride = stride_;
+}
+
+/* Picks the conversion from bits_per_pixel and the bitfields */
+int Fbuffer::SetPixelFormat()
+{
+	auto byte_field = [](fb_bitfield const &f) {
+		return f.length == 8 && f.offset % 8 == 0 && f.offset < 24;
+	};
+	auto short_field = [](fb_bitfield const &f) {
+		return f.length > 0 && f.length <= 8 &&
+		       f.offset + f.length <= 16;
+	};
+	switch (bits_per_pixel) {
+	case 32:
+		format = FbPixelFormat::BGRA32;
+		break;
+	case 24:
+		if (!byte_field(red) || !byte_field(green) || !byte_field(blue))
+			goto handle_err;
+		format = FbPixelFormat::RGB24;
+		break;
+	case 16:
+		if (!short_field(red) || !short_field(green) ||
+		    !short_field(blue))
+			goto handle_err;
+		format = FbPixelFormat::RGB16;
+		break;
+	default:
+		goto handle_err;
+	}
+	pix_size = bits_per_pixel / 8;
+	return 0;
+
+handle_err:
+	errno = EINVAL;
+	return -1;
+}
+
+/* Render buffers, plus the mapping and present thread for ASYNC */
+int Fbuffer::InitBuffers()
+{
+	// tmp for bigger tiles, cache line aligned for streaming stores
+	std::size_t const size = (std::size_t(sizeof(Color) * stride * yres *
+					      1.5) + 63) & ~std::size_t(63);
+	int const n_bufs = present == FbPresentType::ASYNC ? 2 : 1;
+	for (int i = 0; i < n_bufs; ++i) {
+		back[i] = (Color*) aligned_alloc(64, size);
+		if (back[i] == NULL)
+			goto handle_err;
+		/* Defined pixels before the first frame, a full Update
+		 * presents them */
+		memset(back[i], 0, size);
+	}
+	buf = back[0];
+	stale = nullptr;
+	if (present == FbPresentType::SYNC) {
+		if (format != FbPixelFormat::BGRA32)
+			stage.assign(std::size_t(line_length) * yres, 0);
+		return 0;
+	}
+
+	map_size = std::size_t(line_length) * yres;
+	map = (char*) mmap(NULL, map_size, PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		map = nullptr;
+		goto handle_err;
+	}
+	present_pending = false;
+	present_finish = false;
+	present_thread = std::thread(&Fbuffer::PresentRoutine, this);
+	return 0;
+
+handle_err:
+	for (auto &b : back) {
+		free(b);
+		b = nullptr;
+	}
+	buf = nullptr;
+	stale = nullptr;
+	return -1;
+}
+
+Fbuffer::~Fbuffer()
+{
+	Destroy();
+}
+
 int Fbuffer::Destroy()
 {
-	free(buf);
-	return close(fd);
+	StopPresent();
+	if (map != nullptr) {
+		munmap(map, map_size);
+		map = nullptr;
+	}
+	for (auto &b : back) {
+		free(b);
+		b = nullptr;
+	}
+	buf = nullptr;
+	if (fd < 0)
+		return 0;
+	int rc = close(fd);
+	fd = -1;
+	return rc;
 }
 
 int Fbuffer::Update()
 {
-	int rc = pwrite(fd, buf, xres * yres * sizeof(Color), 0);
-	return rc < 0 ? rc : 0;
+	spans.assign(1, Rect{ 0, 0, xres, yres });
+	return Present(false);
+}
+
+int Fbuffer::Update(FbDirtyTiles &dirty)
+{
+	std::uint32_t const ts = dirty.tile_size;
+	spans.clear();
+	for (std::uint32_t ty = 0; ty < dirty.h_tiles; ++ty) {
+		std::uint8_t const *row = &dirty.map[ty * dirty.w_tiles];
+		std::uint32_t const y0 = ty * ts;
+		std::uint32_t const y1 = std::min(y0 + ts, yres);
+		std::uint32_t tx = 0;
+		while (tx < dirty.w_tiles && y0 < y1) {
+			if (!row[tx]) {
+				++tx;
+				continue;
+			}
+			std::uint32_t const beg = tx;
+			while (tx < dirty.w_tiles && row[tx])
+				++tx;
+			spans.push_back(Rect{ beg * ts, y0,
+					      std::min(tx * ts, xres), y1 });
+		}
+	}
+	dirty.Reset();
+	return Present(true);
+}
+
+int Fbuffer::Present(bool keep)
+{
+	if (fd < 0) /* offscreen */
+		return 0;
+	if (present == FbPresentType::SYNC)
+		return WriteSpans();
+
+	/* Blocks only if the previous frame is still being copied */
+	{
+		std::unique_lock<std::mutex> lk(m_present);
+		cv_present.wait(lk, [this] { return !present_pending; });
+		present_buf = buf;
+		std::swap(spans, present_spans);
+		present_pending = true;
+	}
+	cv_present.notify_all();
+	Color const *src = buf;
+	buf = back[buf == back[0]];
+	if (!keep) {
+		/* Swap chain, the next frame redraws buf */
+		stale = buf;
+		return 0;
+	}
+
+	/* buf is two frames old now, the spans just handed off are copied
+	 * in so partly drawn dirty tiles of the next frame keep the
+	 * presented pixels. The present thread only reads them. If buf
+	 * was left undefined by a full Update(), src is whole and is
+	 * copied once */
+	if (buf == stale) {
+		stale = nullptr;
+		memcpy(buf, src, std::size_t(yres) * stride * sizeof(Color));
+		return 0;
+	}
+	for (auto const &r : present_spans)
+		for (std::uint32_t y = r.y0; y < r.y1; ++y)
+			memcpy(buf + std::size_t(y) * stride + r.x0,
+			       src + std::size_t(y) * stride + r.x0,
+			       (r.x1 - r.x0) * sizeof(Color));
+	return 0;
+}
+
+void Fbuffer::PresentRoutine()
+{
+	std::unique_lock<std::mutex> lk(m_present);
+	for (;;) {
+		cv_present.wait(lk, [this] {
+			return present_pending || present_finish;
+		});
+		if (!present_pending)
+			return;
+		Color const *src = present_buf;
+		lk.unlock();
+		CopySpans(map, src, present_spans);
+		lk.lock();
+		present_pending = false;
+		cv_present.notify_all();
+	}
+}
+
+/* Pending frame is still presented */
+void Fbuffer::StopPresent()
+{
+	if (!present_thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lk(m_present);
+		present_finish = true;
+	}
+	cv_present.notify_all();
+	present_thread.join();
+}
+
+/* Span rows in row-major order, one pwrite per run contiguous in both
+ * buf and file. Spans of a tile row share y0 and y1. Pixels between
+ * spans are never written, buf may hold anything there */
+int Fbuffer::WriteSpans()
+{
+	/* Converted formats are written from stage, in device layout */
+	char const *base = reinterpret_cast<char const *>(buf);
+	std::size_t pitch = stride * sizeof(Color);
+	if (format != FbPixelFormat::BGRA32) {
+		CopySpans(stage.data(), buf, spans);
+		base = stage.data();
+		pitch = line_length;
+	}
+
+	char const *run_mem = nullptr;
+	off_t run_offs = 0;
+	std::size_t run_len = 0;
+	std::size_t end;
+	for (std::size_t beg = 0; beg < spans.size(); beg = end) {
+		for (end = beg + 1; end < spans.size() &&
+		     spans[end].y0 == spans[beg].y0; ++end)
+			;
+		for (std::uint32_t y = spans[beg].y0; y < spans[beg].y1; ++y)
+		for (std::size_t i = beg; i < end; ++i) {
+			auto const &r = spans[i];
+			std::size_t const len = (r.x1 - r.x0) * pix_size;
+			char const *mem = base + y * pitch + r.x0 * pix_size;
+			off_t const offs = off_t(y) * line_length +
+					   r.x0 * pix_size;
+			if (run_len && offs == run_offs + off_t(run_len) &&
+			    mem - run_mem == offs - run_offs) {
+				run_len += len;
+				continue;
+			}
+			if (run_len && pwrite(fd, run_mem, run_len, run_offs) !=
+			    ssize_t(run_len))
+				return -1;
+			run_mem = mem;
+			run_offs = offs;
+			run_len = len;
+		}
+	}
+	if (run_len && pwrite(fd, run_mem, run_len, run_offs) !=
+	    ssize_t(run_len))
+		return -1;
+	return 0;
+}
+
+/* Span rows of the render buffer into dst in device layout */
+void Fbuffer::CopySpans(char *dst, Color const *src,
+			std::vector<Rect> const &rects) const
+{
+	for (auto const &r : rects) {
+		for (std::uint32_t y = r.y0; y < r.y1; ++y)
+			ConvertRow(dst + std::size_t(y) * line_length +
+				   r.x0 * pix_size,
+				   src + std::size_t(y) * stride + r.x0,
+				   r.x1 - r.x0);
+	}
+}
+
+void Fbuffer::ConvertRow(char *dst, Color const *src, std::uint32_t n) const
+{
+	std::uint32_t i = 0;
+	if (format == FbPixelFormat::BGRA32) {
+		memcpy(dst, src, n * sizeof(Color));
+		return;
+	}
+
+	if (format == FbPixelFormat::RGB16) {
+		/* Top length bits of each channel to its offset */
+		auto pack = [this](Color c) {
+			return std::uint16_t(
+				(c.r >> (8 - red.length)) << red.offset |
+				(c.g >> (8 - green.length)) << green.offset |
+				(c.b >> (8 - blue.length)) << blue.offset);
+		};
+#ifdef __AVX2__
+		fb_bitfield const *fields[3] = { &blue, &green, &red };
+		__m128i shr[3], shl[3];
+		__m256i mask[3];
+		for (int c = 0; c < 3; ++c) {
+			shr[c] = _mm_cvtsi32_si128(8 * c + 8 - fields[c]->length);
+			shl[c] = _mm_cvtsi32_si128(fields[c]->offset);
+			mask[c] = _mm256_set1_epi32((1 << fields[c]->length) - 1);
+		}
+		auto pack8 = [&](__m256i v) {
+			__m256i out = _mm256_setzero_si256();
+			for (int c = 0; c < 3; ++c)
+				out = _mm256_or_si256(out, _mm256_sll_epi32(
+					_mm256_and_si256(_mm256_srl_epi32(
+					v, shr[c]), mask[c]), shl[c]));
+			return out;
+		};
+		for (; i + 16 <= n; i += 16) {
+			__m256i lo = pack8(_mm256_loadu_si256(
+				(__m256i const *)(src + i)));
+			__m256i hi = pack8(_mm256_loadu_si256(
+				(__m256i const *)(src + i + 8)));
+			/* packus interleaves 128-bit lanes of lo and hi */
+			__m256i v = _mm256_permute4x64_epi64(
+				_mm256_packus_epi32(lo, hi), 0xd8);
+			_mm256_storeu_si256((__m256i *)(dst + 2 * i), v);
+		}
+#endif
+		for (; i < n; ++i) {
+			std::uint16_t p = pack(src[i]);
+			memcpy(dst + 2 * i, &p, sizeof(p));
+		}
+		return;
+	}
+
+	/* RGB24, byte k of a pixel is the channel at offset 8 k */
+	std::uint8_t src_byte[3];
+	src_byte[blue.offset / 8] = 0;
+	src_byte[green.offset / 8] = 1;
+	src_byte[red.offset / 8] = 2;
+#ifdef __AVX2__
+	/* 4 pixels per 128-bit lane, each lane stores 16 bytes of which 12
+	 * are used, the last lane must not write past dst end */
+	alignas(16) std::int8_t shuf[16];
+	for (int b = 0; b < 16; ++b)
+		shuf[b] = b < 12 ? 4 * (b / 3) + src_byte[b % 3] : -1;
+	__m256i const shuf2 = _mm256_broadcastsi128_si256(
+		_mm_load_si128((__m128i const *)shuf));
+	for (; i + 8 + 2 <= n; i += 8) {
+		__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(
+			(__m256i const *)(src + i)), shuf2);
+		_mm_storeu_si128((__m128i *)(dst + 3 * i),
+				 _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i *)(dst + 3 * i + 12),
+				 _mm256_extracti128_si256(v, 1));
+	}
+#endif
+	for (; i < n; ++i) {
+		std::uint8_t const *s =
+			reinterpret_cast<std::uint8_t const *>(src + i);
+		for (int k = 0; k < 3; ++k)
+			dst[3 * i + k] = s[src_byte[k]];
+	}
+}
+
+int Fbuffer::DumpPpm(const char *path) const
+{
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+		return -1;
+
+	fprintf(f, "P6\n%u %u\n255\n", xres, yres);
+
+	unsigned char *row = (unsigned char*) malloc(3 * xres);
+	if (row == NULL)
+		goto handle_err;
+
+	for (std::uint32_t y = 0; y < yres; ++y) {
+		Color const *src = (*this)[y];
+		for (std::uint32_t x = 0; x < xres; ++x) {
+			row[3 * x + 0] = src[x].r;
+			row[3 * x + 1] = src[x].g;
+			row[3 * x + 2] = src[x].b;
+		}
+		if (fwrite(row, 3, xres, f) != xres) {
+			free(row);
+			goto handle_err;
+		}
+	}
+	free(row);
+	return fclose(f) == 0 ? 0 : -1;
+
+handle_err:
+	fclose(f);
+	return -1;
 }
@@ -0,0 +1,338 @@
+#include <include/mesh_opt.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+/* misses[t] is the number of misses before triangle t */
+static void FifoMisses(std::vector<Wfobj::Mesh::Index> const &inds,
+	std::size_t n_verts, uint32_t cache_size,
+	std::vector<uint32_t> &misses)
+{
+	/* v is cached while less than cache_size misses passed since its
+	 * own one */
+	std::vector<uint64_t> stamp(n_verts, 0);
+	uint64_t s = cache_size + 1;
+	uint32_t n_misses = 0;
+
+	misses.resize(inds.size() / 3 + 1);
+	for (std::size_t t = 0; t < inds.size() / 3; ++t) {
+		misses[t] = n_misses;
+		for (int c = 0; c < 3; ++c) {
+			auto const v = inds[t * 3 + c];
+			if (s - stamp[v] > cache_size) {
+				stamp[v] = s++;
+				++n_misses;
+			}
+		}
+	}
+	misses[inds.size() / 3] = n_misses;
+}
+
+float MeshAcmr(Wfobj::Mesh const &mesh, uint32_t cache_size)
+{
+	std::size_t const n_tris = mesh.inds.size() / 3;
+	if (!n_tris)
+		return 0;
+	std::vector<uint32_t> misses;
+	FifoMisses(mesh.inds, mesh.verts.size(), cache_size, misses);
+	return float(misses[n_tris]) / n_tris;
+}
+
+/* Front faces are rasterized at pixel centers in mesh order, one
+ * orthographic view per axis direction, fragments that pass a less
+ * depth test count as shaded */
+float MeshOverdraw(Wfobj::Mesh const &mesh, uint32_t res)
+{
+	auto const &inds = mesh.inds;
+	auto const &verts = mesh.verts;
+	if (inds.empty() || !res)
+		return 0;
+
+	Vec3 lo = verts[inds[0]].pos, hi = lo;
+	for (auto v : inds) {
+		Vec3 const &p = verts[v].pos;
+		lo = { std::min(lo.x, p.x), std::min(lo.y, p.y),
+		       std::min(lo.z, p.z) };
+		hi = { std::max(hi.x, p.x), std::max(hi.y, p.y),
+		       std::max(hi.z, p.z) };
+	}
+	float ext = std::max(hi.x - lo.x, std::max(hi.y - lo.y, hi.z - lo.z));
+	float const scale = ext > 0 ? res / ext : 0;
+
+	std::vector<float> zbuf(res * res);
+	uint64_t n_shaded = 0, n_covered = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		int const ax_u = (axis + 1) % 3, ax_v = (axis + 2) % 3;
+		for (float dir : { 1.0f, -1.0f }) {
+			std::fill(zbuf.begin(), zbuf.end(),
+				  -std::numeric_limits<float>::infinity());
+			for (std::size_t t = 0; t < inds.size(); t += 3) {
+				Vec3 s[3];
+				for (int c = 0; c < 3; ++c) {
+					Vec3 const &p = verts[inds[t + c]].pos;
+					s[c] = { (p[ax_u] - lo[ax_u]) * scale,
+						 (p[ax_v] - lo[ax_v]) * scale,
+						 dir * p[axis] };
+				}
+				float const area =
+					(s[1].x - s[0].x) * (s[2].y - s[0].y) -
+					(s[1].y - s[0].y) * (s[2].x - s[0].x);
+				if (!(dir * area > 0))
+					continue;
+				float const inv = 1 / area;
+				int x0 = std::max(0.0f, std::floor(std::min(
+					s[0].x, std::min(s[1].x, s[2].x))));
+				int y0 = std::max(0.0f, std::floor(std::min(
+					s[0].y, std::min(s[1].y, s[2].y))));
+				int x1 = std::min(float(res - 1), std::ceil(
+					std::max(s[0].x, std::max(s[1].x, s[2].x))));
+				int y1 = std::min(float(res - 1), std::ceil(
+					std::max(s[0].y, std::max(s[1].y, s[2].y))));
+				for (int y = y0; y <= y1; ++y)
+				for (int x = x0; x <= x1; ++x) {
+					float const px = x + 0.5f, py = y + 0.5f;
+					float w[3];
+					for (int c = 0; c < 3; ++c) {
+						Vec3 const &a = s[(c + 1) % 3];
+						Vec3 const &b = s[(c + 2) % 3];
+						w[c] = ((b.x - a.x) * (py - a.y) -
+							(b.y - a.y) * (px - a.x)) * inv;
+					}
+					if (w[0] < 0 || w[1] < 0 || w[2] < 0)
+						continue;
+					float const z = w[0] * s[0].z +
+						w[1] * s[1].z + w[2] * s[2].z;
+					float &zb = zbuf[y * res + x];
+					if (z <= zb)
+						continue;
+					n_covered += zb ==
+					    -std::numeric_limits<float>::infinity();
+					zb = z;
+					++n_shaded;
+				}
+			}
+		}
+	}
+	return n_covered ? float(n_shaded) / n_covered : 0;
+}
+
+/* Sander et al., "Fast Triangle Reordering for Vertex Locality and
+ * Reduced Overdraw", order is the new triangle sequence, dead ends are
+ * positions in it where the fan had to jump to a cold vertex */
+static void Tipsify(Wfobj::Mesh const &mesh, uint32_t cache_size,
+	std::vector<uint32_t> &order, std::vector<uint32_t> &dead_ends)
+{
+	auto const &inds = mesh.inds;
+	std::size_t const n_verts = mesh.verts.size();
+	std::size_t const n_tris = inds.size() / 3;
+
+	/* Vertex -> adjacent triangles */
+	std::vector<uint32_t> adj_offs(n_verts + 1, 0);
+	std::vector<uint32_t> adj(inds.size());
+	for (auto v : inds)
+		++adj_offs[v + 1];
+	std::partial_sum(adj_offs.begin(), adj_offs.end(), adj_offs.begin());
+	std::vector<uint32_t> adj_fill(adj_offs.begin(), adj_offs.end() - 1);
+	for (std::size_t i = 0; i < inds.size(); ++i)
+		adj[adj_fill[inds[i]]++] = i / 3;
+
+	std::vector<uint32_t> live(n_verts);
+	for (std::size_t v = 0; v < n_verts; ++v)
+		live[v] = adj_offs[v + 1] - adj_offs[v];
+	std::vector<uint64_t> stamp(n_verts, 0);
+	std::vector<uint8_t> emitted(n_tris, 0);
+	std::vector<uint32_t> dead_end_stack;
+	std::vector<uint32_t> cand;
+	uint64_t s = cache_size + 1;
+	uint32_t cursor = 0;
+
+	order.clear();
+	order.reserve(n_tris);
+	dead_ends.clear();
+
+	int64_t fan = n_verts ? 0 : -1;
+	while (fan >= 0) {
+		cand.clear();
+		for (auto a = adj_offs[fan]; a < adj_offs[fan + 1]; ++a) {
+			auto const t = adj[a];
+			if (emitted[t])
+				continue;
+			for (int c = 0; c < 3; ++c) {
+				auto const v = inds[t * 3 + c];
+				dead_end_stack.push_back(v);
+				cand.push_back(v);
+				--live[v];
+				if (s - stamp[v] > cache_size)
+					stamp[v] = s++;
+			}
+			emitted[t] = 1;
+			order.push_back(t);
+		}
+
+		/* Next fan: the oldest cached vertex that stays cached while
+		 * its remaining triangles are emitted, else any live one */
+		int64_t next = -1, best = -1;
+		for (auto v : cand) {
+			if (!live[v])
+				continue;
+			int64_t p = 0;
+			if (s - stamp[v] + 2 * live[v] <= cache_size)
+				p = s - stamp[v];
+			if (p > best) {
+				best = p;
+				next = v;
+			}
+		}
+		if (next < 0) {
+			dead_ends.push_back(order.size());
+			while (!dead_end_stack.empty() && next < 0) {
+				auto const v = dead_end_stack.back();
+				dead_end_stack.pop_back();
+				if (live[v])
+					next = v;
+			}
+			for (; next < 0 && cursor < n_verts; ++cursor)
+				if (live[cursor])
+					next = cursor;
+		}
+		fan = next;
+	}
+}
+
+void MeshOptimize(Wfobj::Mesh &mesh, uint32_t cache_size)
+{
+	auto &inds = mesh.inds;
+	auto &verts = mesh.verts;
+	std::size_t const n_tris = inds.size() / 3;
+	if (!n_tris)
+		return;
+
+	std::vector<uint32_t> order, dead_ends;
+	Tipsify(mesh, cache_size, order, dead_ends);
+
+	std::vector<Wfobj::Mesh::Index> tip_inds(inds.size());
+	for (std::size_t t = 0; t < n_tris; ++t)
+		for (int c = 0; c < 3; ++c)
+			tip_inds[t * 3 + c] = inds[order[t] * 3 + c];
+
+	/* Clusters end at dead ends where their own ACMR is already at
+	 * most the overall one, so reordering them costs few misses */
+	std::vector<uint32_t> misses;
+	FifoMisses(tip_inds, verts.size(), cache_size, misses);
+	float const lambda = float(misses[n_tris]) / n_tris;
+	std::vector<uint32_t> clusters = { 0 };
+	dead_ends.push_back(n_tris);
+	for (auto end : dead_ends) {
+		auto const beg = clusters.back();
+		if (end <= beg)
+			continue;
+		if (end == n_tris ||
+		    misses[end] - misses[beg] <= lambda * (end - beg))
+			clusters.push_back(end);
+	}
+
+	/* Coarse key: Morton cell of the cluster centroid, octants of the
+	 * mesh bounds, finer cells split front and back sides apart and
+	 * leave the occlusion sort little to reorder.
+	 * Within a cell clusters go by occlusion potential, how far out the
+	 * cluster faces from the mesh center, outer ones first so they
+	 * occlude the rest (Tipsify's overdraw pass, done per cell) */
+	auto const tri_area_norm = [&](std::size_t t, Vec3 &center) {
+		Vec3 const &p0 = verts[tip_inds[t * 3 + 0]].pos;
+		Vec3 const &p1 = verts[tip_inds[t * 3 + 1]].pos;
+		Vec3 const &p2 = verts[tip_inds[t * 3 + 2]].pos;
+		center = (1.0f / 3) * (p0 + p1 + p2);
+		return CrossProd(p1 - p0, p2 - p0);
+	};
+	Vec3 lo = verts[tip_inds[0]].pos, hi = lo;
+	Vec3 mesh_center = { 0, 0, 0 };
+	float mesh_area = 0;
+	for (std::size_t t = 0; t < n_tris; ++t) {
+		Vec3 center;
+		float const area = Length(tri_area_norm(t, center));
+		mesh_center = mesh_center + area * center;
+		mesh_area += area;
+		for (int c = 0; c < 3; ++c) {
+			Vec3 const &p = verts[tip_inds[t * 3 + c]].pos;
+			lo = { std::min(lo.x, p.x), std::min(lo.y, p.y),
+			       std::min(lo.z, p.z) };
+			hi = { std::max(hi.x, p.x), std::max(hi.y, p.y),
+			       std::max(hi.z, p.z) };
+		}
+	}
+	if (mesh_area > 0)
+		mesh_center = (1 / mesh_area) * mesh_center;
+
+	/* 1 bit per axis, 8 cells */
+	int const cell_bits = 1;
+	uint32_t const cell_max = (1u << cell_bits) - 1;
+	auto const quant = [&](float p, float l, float h) {
+		float const q = h > l ? (p - l) / (h - l) * (cell_max + 1) : 0;
+		return std::min(uint32_t(std::max(q, 0.0f)), cell_max);
+	};
+	auto const spread = [&](uint32_t x) {
+		uint32_t r = 0;
+		for (int i = 0; i < cell_bits; ++i)
+			r |= (x >> i & 1) << (3 * i);
+		return r;
+	};
+
+	std::size_t const n_clusters = clusters.size() - 1;
+	std::vector<uint32_t> cell(n_clusters);
+	std::vector<float> potential(n_clusters);
+	for (std::size_t i = 0; i < n_clusters; ++i) {
+		Vec3 cl_center = { 0, 0, 0 }, cl_norm = { 0, 0, 0 };
+		Vec3 cl_mean = { 0, 0, 0 };
+		float cl_area = 0;
+		for (auto t = clusters[i]; t < clusters[i + 1]; ++t) {
+			Vec3 center;
+			Vec3 const norm = tri_area_norm(t, center);
+			float const area = Length(norm);
+			cl_center = cl_center + area * center;
+			cl_mean = cl_mean + center;
+			cl_norm = cl_norm + norm;
+			cl_area += area;
+		}
+		cl_mean = (1.0f / (clusters[i + 1] - clusters[i])) * cl_mean;
+		cell[i] = spread(quant(cl_mean.x, lo.x, hi.x)) |
+			  spread(quant(cl_mean.y, lo.y, hi.y)) << 1 |
+			  spread(quant(cl_mean.z, lo.z, hi.z)) << 2;
+
+		float const norm_len = Length(cl_norm);
+		if (cl_area > 0 && norm_len > 0) {
+			cl_center = (1 / cl_area) * cl_center;
+			potential[i] = DotProd(cl_center - mesh_center,
+					       (1 / norm_len) * cl_norm);
+		} else {
+			potential[i] = 0;
+		}
+	}
+	std::vector<uint32_t> cl_order(n_clusters);
+	std::iota(cl_order.begin(), cl_order.end(), 0);
+	std::stable_sort(cl_order.begin(), cl_order.end(),
+		[&](uint32_t a, uint32_t b) {
+			if (cell[a] != cell[b])
+				return cell[a] < cell[b];
+			return potential[a] > potential[b];
+		});
+
+	inds.clear();
+	for (auto cl : cl_order)
+		inds.insert(inds.end(), tip_inds.begin() + clusters[cl] * 3,
+			    tip_inds.begin() + clusters[cl + 1] * 3);
+
+	/* Vertices in first-use order, unreferenced ones are dropped */
+	std::vector<Wfobj::Mesh::Index> remap(verts.size(), UINT32_MAX);
+	std::vector<Vertex> new_verts;
+	new_verts.reserve(verts.size());
+	for (auto &v : inds) {
+		if (remap[v] == UINT32_MAX) {
+			remap[v] = new_verts.size();
+			new_verts.push_back(verts[v]);
+		}
+		v = remap[v];
+	}
+	verts.swap(new_verts);
+}
@@ -0,0 +1,54 @@
+extern "C" {
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+};
+
+#include "include/mmap_file.h"
+
+int MmapFile::Map(char const *path)
+{
+	struct stat st;
+	void *map_region;
+
+	Unmap();
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		goto handle_err_0;
+
+	if (fstat(fd, &st) < 0)
+		goto handle_err_1;
+
+	size = st.st_size;
+	if (size == 0) {
+		/* mmap of empty file fails, nothing to read anyway */
+		data = "";
+		close(fd);
+		return 0;
+	}
+
+	map_region = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map_region == MAP_FAILED)
+		goto handle_err_1;
+	madvise(map_region, size, MADV_SEQUENTIAL);
+	close(fd);
+
+	data = (char const *)map_region;
+	return 0;
+
+handle_err_1:
+	close(fd);
+handle_err_0:
+	size = 0;
+	return -1;
+}
+
+void MmapFile::Unmap()
+{
+	if (data && size)
+		munmap((void *)data, size);
+	data = nullptr;
+	size = 0;
+}
@@ -1,51 +1,105 @@
 #include <include/ppm.h>
+#include <include/mmap_file.h>
 
-#include <cstdlib>
-#include <utility>
-#include <fstream>
-#include <sstream>
-#include <vector>
-#include <unordered_map>
+#include <algorithm>
+#include <thread>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/* Header token: skips whitespace and '#' comments up to end of line */
+static bool PpmToken(char const *&p, char const *end, uint32_t *val,
+	char const *magic = nullptr)
+{
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' ||
+				   *p == '\n' || *p == '\v' || *p == '\f'))
+			++p;
+		if (p == end || *p != '#')
+			break;
+		while (p < end && *p != '\n')
+			++p;
+	}
+	if (magic) {
+		for (; *magic; ++magic, ++p)
+			if (p == end || *p != *magic)
+				return false;
+		return true;
+	}
+	if (p == end || *p < '0' || *p > '9')
+		return false;
+	*val = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+		*val = *val * 10 + (*p++ - '0');
+	return true;
+}
+
+/* r, g, b bytes -> b, g, r, 255 texels */
+static void RgbToBgra(uint8_t const *src, PpmImg::Color *dst, std::size_t n)
+{
+	std::size_t i = 0;
+#ifdef __AVX2__
+	/* 4 texels per 128-bit lane, each lane loads 16 bytes of which 12
+	 * are used, the last lane must not read past src end */
+	__m256i const shuf = _mm256_setr_epi8(
+		2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+		2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	__m256i const alpha = _mm256_set1_epi32(int32_t(0xff000000));
+	for (; i + 8 + 2 <= n; i += 8) {
+		uint8_t const *s = src + i * 3;
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((__m128i const *)s)),
+			_mm_loadu_si128((__m128i const *)(s + 12)), 1);
+		v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), alpha);
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	}
+#endif
+	for (; i < n; ++i)
+		dst[i] = PpmImg::Color { src[i * 3 + 2], src[i * 3 + 1],
+					 src[i * 3], 255 };
+}
 
 int PpmImg::Import(char const *path)
 {
-	std::ifstream in(path);
-	if (!in.is_open())
+	MmapFile file;
+	if (file.Map(path) < 0)
 		return -1;
-	std::string line;
-	for (int counter = 0; counter < 4;) {
-		if (!(std::getline(in, line)))
-			return -1;
-		if (line[0] == '#')
-			continue;
-		std::istringstream iss(line);
-		std::string word;
-		while (!iss.eof()) {
-			if (counter == 0) {
-				iss >> word;
-				if (word != "P6")
-					return -1;
-				++counter;
-			} else if(counter == 1) {
-				if (iss >> w)
-					++counter;
-			} else if(counter == 2) {
-				if (iss >> h)
-					++counter;
-			} else if(counter == 3) {
-				int i_dont_use_this;
-				if (iss >> i_dont_use_this)
-					++counter;
-			} else
-				return -1;
-		}
-	}
-	buf.resize(w * h);
+	char const *p = file.data;
+	char const *end = file.data + file.size;
+	uint32_t max_val;
+	if (!PpmToken(p, end, nullptr, "P6") || !PpmToken(p, end, &w) ||
+	    !PpmToken(p, end, &h) || !PpmToken(p, end, &max_val))
+		return -1;
+	/* 8-bit channels of full range only */
+	if (max_val != 255)
+		return -1;
+	/* Single whitespace before the raster */
+	if (p == end)
+		return -1;
+	++p;
 
-	in.read(reinterpret_cast<char*>(&buf[0]),
-			buf.size() * sizeof(Color));
-	if (!in.good())
+	std::size_t const n = std::size_t(w) * h;
+	if (std::size_t(end - p) < n * 3)
 		return -1;
+	buf.resize(n);
+
+	/* Rows split between threads for big images */
+	std::size_t const min_chunk = 1 << 20;
+	std::size_t n_chunks = std::max<std::size_t>(1, std::min<std::size_t>(
+		std::thread::hardware_concurrency(), n / min_chunk));
+	auto const src = reinterpret_cast<uint8_t const *>(p);
+	auto const convert = [&](std::size_t i) {
+		std::size_t beg = n * i / n_chunks;
+		std::size_t end = n * (i + 1) / n_chunks;
+		RgbToBgra(src + beg * 3, &buf[beg], end - beg);
+	};
+	std::vector<std::thread> threads;
+	for (std::size_t i = 1; i < n_chunks; ++i)
+		threads.emplace_back(convert, i);
+	convert(0);
+	for (auto &thread : threads)
+		thread.join();
 
 	return 0;
 }
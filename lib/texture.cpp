@@ -0,0 +1,229 @@
+#include <include/texture.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static float DotAxis(float const (&a)[3], float const (&b)[3])
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+uint32_t Texture::AddLevelTable(uint32_t lw, uint32_t lh)
+{
+	uint32_t const l = n_levels++;
+	lvl_w[l] = lw;
+	lvl_h[l] = lh;
+	lvl_offs[l] = buf.size();
+	lvl_scale_x[l] = float(lw) / w;
+	lvl_scale_y[l] = float(lh) / h;
+
+	if (layout == TexLayout::LINEAR) {
+		lvl_pitch[l] = lw;
+		return lw * lh;
+	}
+	uint32_t const w_blocks = (lw + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+	uint32_t const h_blocks = (lh + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+	lvl_pitch[l] = w_blocks;
+	if (layout == TexLayout::BC1)
+		return w_blocks * h_blocks * 2;
+	return w_blocks * h_blocks * BLOCK_SIZE * BLOCK_SIZE;
+}
+
+void Texture::AddLevel(Color const *src, uint32_t lw, uint32_t lh)
+{
+	uint32_t const l = n_levels;
+	uint32_t const size = AddLevelTable(lw, lh);
+	if (layout == TexLayout::LINEAR) {
+		buf.insert(buf.end(), src, src + size);
+		return;
+	}
+
+	/* Edge blocks are padded with copies of the border texels */
+	uint32_t const w_blocks = lvl_pitch[l];
+	uint32_t const h_blocks = (lh + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+	buf.resize(buf.size() + size);
+
+	if (layout == TexLayout::BC1) {
+		for (uint32_t by = 0; by < h_blocks; ++by) {
+			for (uint32_t bx = 0; bx < w_blocks; ++bx) {
+				Color texels[16];
+				for (uint32_t i = 0; i < 16; ++i) {
+					uint32_t x = bx * BLOCK_SIZE + i % 4;
+					uint32_t y = by * BLOCK_SIZE + i / 4;
+					texels[i] = src[std::min(x, lw - 1) +
+						std::min(y, lh - 1) * lw];
+				}
+				Color block[2];
+				EncodeBc1(texels, block);
+				auto offs = get_offs(bx * BLOCK_SIZE,
+						     by * BLOCK_SIZE, l);
+				buf[offs] = block[0];
+				buf[offs + 1] = block[1];
+			}
+		}
+		return;
+	}
+	for (uint32_t y = 0; y < h_blocks * BLOCK_SIZE; ++y) {
+		uint32_t const src_y = std::min(y, lh - 1);
+		for (uint32_t x = 0; x < w_blocks * BLOCK_SIZE; ++x) {
+			uint32_t const src_x = std::min(x, lw - 1);
+			buf[get_offs(x, y, l)] = src[src_x + src_y * lw];
+		}
+	}
+}
+
+/* Ends are the extreme texels along the principal axis of the block
+ * colors, each texel takes the nearest palette entry */
+void Texture::EncodeBc1(Color const (&texels)[16], Color (&block)[2])
+{
+	float mean[3] = { 0, 0, 0 };
+	float col[16][3];
+	for (int i = 0; i < 16; ++i) {
+		col[i][0] = texels[i].r;
+		col[i][1] = texels[i].g;
+		col[i][2] = texels[i].b;
+		for (int k = 0; k < 3; ++k)
+			mean[k] += col[i][k] / 16;
+	}
+	float cov[3][3] = {};
+	for (int i = 0; i < 16; ++i)
+		for (int j = 0; j < 3; ++j)
+			for (int k = 0; k < 3; ++k)
+				cov[j][k] += (col[i][j] - mean[j]) *
+					     (col[i][k] - mean[k]);
+	float axis[3] = { 1, 1, 1 };
+	for (int it = 0; it < 8; ++it) {
+		float next[3], len = 0;
+		for (int j = 0; j < 3; ++j) {
+			next[j] = DotAxis(cov[j], axis);
+			len = std::max(len, std::abs(next[j]));
+		}
+		if (len == 0)
+			break;
+		for (int j = 0; j < 3; ++j)
+			axis[j] = next[j] / len;
+	}
+	int i_min = 0, i_max = 0;
+	float p_min = DotAxis(col[0], axis), p_max = p_min;
+	for (int i = 1; i < 16; ++i) {
+		float p = DotAxis(col[i], axis);
+		if (p < p_min) {
+			p_min = p;
+			i_min = i;
+		}
+		if (p > p_max) {
+			p_max = p;
+			i_max = i;
+		}
+	}
+
+	auto to565 = [](Color c) {
+		return uint32_t(((c.r * 31 + 127) / 255) << 11 |
+				((c.g * 63 + 127) / 255) << 5 |
+				((c.b * 31 + 127) / 255));
+	};
+	uint32_t c0 = to565(texels[i_max]), c1 = to565(texels[i_min]);
+	if (c0 < c1)
+		std::swap(c0, c1);
+	uint32_t const ends = c0 | c1 << 16;
+	uint32_t bits = 0;
+	if (c0 != c1) {
+		Color pal[4];
+		for (uint32_t sel = 0; sel < 4; ++sel)
+			pal[sel] = Bc1Color(ends, sel << (2 * sel), sel);
+		for (int i = 0; i < 16; ++i) {
+			uint32_t best = 0;
+			int best_d = INT32_MAX;
+			for (uint32_t sel = 0; sel < 4; ++sel) {
+				int dr = pal[sel].r - texels[i].r;
+				int dg = pal[sel].g - texels[i].g;
+				int db = pal[sel].b - texels[i].b;
+				int d = dr * dr + dg * dg + db * db;
+				if (d < best_d) {
+					best_d = d;
+					best = sel;
+				}
+			}
+			bits |= best << (2 * i);
+		}
+	}
+	memcpy(&block[0], &ends, sizeof(ends));
+	memcpy(&block[1], &bits, sizeof(bits));
+}
+
+void Texture::Import(PpmImg const &img, TexLayout layout_, bool mipmaps)
+{
+	layout = layout_;
+	w = img.w;
+	h = img.h;
+	n_levels = 0;
+	buf.clear();
+	if (!w || !h)
+		return;
+	AddLevel(img.buf.data(), w, h);
+
+	/* Each level averages 2x2 texels of the previous one, odd edges
+	 * reuse the last row or column */
+	std::vector<Color> prev = img.buf, cur;
+	uint32_t pw = w, ph = h;
+	while (mipmaps && (pw > 1 || ph > 1) && n_levels < MAX_LEVELS) {
+		uint32_t const lw = std::max(pw / 2, 1u);
+		uint32_t const lh = std::max(ph / 2, 1u);
+		cur.resize(lw * lh);
+		for (uint32_t y = 0; y < lh; ++y) {
+			uint32_t const y0 = std::min(2 * y, ph - 1);
+			uint32_t const y1 = std::min(2 * y + 1, ph - 1);
+			for (uint32_t x = 0; x < lw; ++x) {
+				uint32_t const x0 = std::min(2 * x, pw - 1);
+				uint32_t const x1 = std::min(2 * x + 1, pw - 1);
+				Color const c[4] = {
+					prev[x0 + y0 * pw], prev[x1 + y0 * pw],
+					prev[x0 + y1 * pw], prev[x1 + y1 * pw]
+				};
+				auto avg = [&](uint8_t Color::*ch) {
+					return uint8_t((c[0].*ch + c[1].*ch +
+						c[2].*ch + c[3].*ch + 2) >> 2);
+				};
+				cur[x + y * lw] = Color { avg(&Color::b),
+					avg(&Color::g), avg(&Color::r),
+					avg(&Color::a) };
+			}
+		}
+		AddLevel(cur.data(), lw, lh);
+		prev.swap(cur);
+		pw = lw;
+		ph = lh;
+	}
+}
+
+bool Texture::Assign(TexLayout layout_, uint32_t w_, uint32_t h_,
+	uint32_t n_levels_, uint32_t const (*lvl_size)[2],
+	Color const *texels, std::size_t n_texels)
+{
+	layout = layout_;
+	w = w_;
+	h = h_;
+	n_levels = 0;
+	buf.clear();
+	/* Keeps level sizes in uint32_t */
+	uint32_t const max_size = 1 << 15;
+	if (n_levels_ > MAX_LEVELS || w > max_size || h > max_size ||
+	    (n_levels_ && (!w || !h)))
+		return false;
+	std::size_t size = 0;
+	for (uint32_t l = 0; l < n_levels_; ++l) {
+		uint32_t const lw = lvl_size[l][0], lh = lvl_size[l][1];
+		if (!lw || !lh || lw > w || lh > h)
+			return false;
+		/* Offsets of the tables come from buf */
+		size += AddLevelTable(lw, lh);
+		if (size > n_texels)
+			return false;
+		buf.resize(size);
+	}
+	if (size != n_texels)
+		return false;
+	std::copy(texels, texels + n_texels, buf.begin());
+	return true;
+}
@@ -1,11 +1,14 @@
 #include <include/wfobj.h>
+#include <include/mmap_file.h>
 
 #include <utility>
-#include <fstream>
-#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
 #include <unordered_map>
 
-void Wfobj::get_prim_buf(std::vector<std::array<Vertex, 3>> &out)
+void Wfobj::get_prim_buf(std::vector<std::array<Vertex, 3>> &out) const
 {
 	for (std::size_t n = 0; n < mesh.inds.size(); n += 3) {
 		std::array<Vertex, 3> prim = {
@@ -17,129 +20,449 @@ void Wfobj::get_prim_buf(std::vector<std::array<Vertex, 3>> &out)
 	}
 }
 
+/* Line parser over mapped text, fields are separated by spaces, tabs
+ * or '\r', p never passes the end of line */
+struct ObjLine {
+	char const *p;
+	char const *end;
+
+	static bool IsSpace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\v' ||
+		       c == '\f';
+	}
+
+	void SkipSpace()
+	{
+		while (p < end && IsSpace(*p))
+			++p;
+	}
+
+	bool Word(char const *&beg, std::size_t &len)
+	{
+		SkipSpace();
+		beg = p;
+		while (p < end && !IsSpace(*p))
+			++p;
+		len = p - beg;
+		return len != 0;
+	}
+
+	bool Word(std::string &word)
+	{
+		char const *beg;
+		std::size_t len;
+		if (!Word(beg, len))
+			return false;
+		word.assign(beg, len);
+		return true;
+	}
+
+	bool Char(char &c)
+	{
+		SkipSpace();
+		if (p == end)
+			return false;
+		c = *p++;
+		return true;
+	}
+
+	bool Uint(std::size_t &val)
+	{
+		SkipSpace();
+		if (p == end || *p < '0' || *p > '9')
+			return false;
+		val = 0;
+		while (p < end && *p >= '0' && *p <= '9')
+			val = val * 10 + (*p++ - '0');
+		return true;
+	}
+
+	bool Int(int &val)
+	{
+		SkipSpace();
+		bool neg = p < end && *p == '-';
+		if (p < end && (*p == '-' || *p == '+'))
+			++p;
+		std::size_t tmp;
+		if (!Uint(tmp))
+			return false;
+		val = neg ? -int(tmp) : int(tmp);
+		return true;
+	}
+
+	/* Exact when the decimal mantissa and its power of ten fit in
+	 * float, otherwise strtof: the same rounding as operator>> */
+	bool Float(float &val)
+	{
+		static float const pow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f,
+			1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+		SkipSpace();
+		char const *beg = p;
+		bool neg = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			neg = *p++ == '-';
+
+		uint64_t mant = 0;
+		int n_digits = 0, exp10 = 0;
+		bool fast = true;
+		for (; p < end && *p >= '0' && *p <= '9'; ++p, ++n_digits) {
+			mant = mant * 10 + (*p - '0');
+			fast &= mant <= (1 << 24);
+		}
+		if (p < end && *p == '.') {
+			for (++p; p < end && *p >= '0' && *p <= '9';
+			     ++p, ++n_digits) {
+				mant = mant * 10 + (*p - '0');
+				fast &= mant <= (1 << 24);
+				--exp10;
+			}
+		}
+		if (n_digits == 0)
+			goto slow;
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			char const *exp_beg = p++;
+			bool exp_neg = false;
+			if (p < end && (*p == '-' || *p == '+'))
+				exp_neg = *p++ == '-';
+			int exp = 0;
+			if (p == end || *p < '0' || *p > '9') {
+				p = exp_beg;
+				goto slow;
+			}
+			for (; p < end && *p >= '0' && *p <= '9'; ++p)
+				exp = std::min(exp * 10 + (*p - '0'), 1000);
+			exp10 += exp_neg ? -exp : exp;
+		}
+		if (p < end && !IsSpace(*p))
+			goto slow;
+		if (!fast || exp10 < -10 || exp10 > 10)
+			goto slow;
+		if (exp10 >= 0)
+			val = float(mant) * pow10[exp10];
+		else
+			val = float(mant) / pow10[-exp10];
+		if (neg)
+			val = -val;
+		return true;
+slow:
+		p = beg;
+		char buf[64];
+		std::size_t len = 0;
+		while (p < end && !IsSpace(*p) && len < sizeof(buf) - 1)
+			buf[len++] = *p++;
+		buf[len] = 0;
+		char *num_end;
+		val = std::strtof(buf, &num_end);
+		if (num_end == buf)
+			return false;
+		p = beg + (num_end - buf);
+		return true;
+	}
+};
+
+static char const *FindLineEnd(char const *p, char const *end)
+{
+	char const *nl = (char const *)memchr(p, '\n', end - p);
+	return nl ? nl : end;
+}
+
+static bool WordIs(char const *beg, std::size_t len, char const *word)
+{
+	return len == strlen(word) && !memcmp(beg, word, len);
+}
+
 void ImportMtlFile(char const *path,
-	std::unordered_map<std::string, Wfobj::Mtl> &map)
+	std::unordered_map<std::string, Wfobj::Mtl> &map,
+	std::vector<WfobjCacheDep> &deps, WfobjTexFormat tex_fmt)
 {
-	std::ifstream in(path);
-	if (!in.is_open())
+	MmapFile file;
+	if (file.Map(path) < 0)
 		throw std::invalid_argument("Can not find file " +
 					std::string(path));
-	Wfobj::Mtl *cur;
-
-	std::string line;
-	while (std::getline(in, line)) {
-		std::istringstream iss(line);
-		std::string word;
-		iss >> word;
-		if (word == "illum") {
+	Wfobj::Mtl *cur = nullptr;
+
+	char const *file_end = file.data + file.size;
+	ObjLine line;
+	for (char const *p = file.data; p < file_end; p = line.end + 1) {
+		line = { p, FindLineEnd(p, file_end) };
+		char const *beg;
+		std::size_t len;
+		if (!line.Word(beg, len))
+			continue;
+		if (WordIs(beg, len, "newmtl")) {
+			std::string word;
+			if (!line.Word(word))
+				goto handle_err;
+			cur = &map[word];
+			continue;
+		}
+		bool known = WordIs(beg, len, "illum") ||
+			     WordIs(beg, len, "Ns") ||
+			     WordIs(beg, len, "Ka") ||
+			     WordIs(beg, len, "Kd") ||
+			     WordIs(beg, len, "Ks") ||
+			     WordIs(beg, len, "map_Kd");
+		if (!known)
+			continue;
+		if (!cur)
+			goto handle_err;
+		if (WordIs(beg, len, "illum")) {
 			int tmp;
-			if (!(iss >> tmp))
+			if (!line.Int(tmp))
 				goto handle_err;
 			cur->illum = static_cast<Wfobj::Mtl::IllumType> (tmp);
-		} else if (word == "Ns") {
-			if (!(iss >> cur->ns))
-				goto handle_err;
-		} else if (word == "Ka") {
-			if (!(iss >>  cur->amb.r >>  cur->amb.g >>  cur->amb.b))
+		} else if (WordIs(beg, len, "Ns")) {
+			if (!line.Float(cur->ns))
 				goto handle_err;
-		} else if (word == "Kd") {
-			if (!(iss >> cur->diff.r >> cur->diff.g >> cur->diff.b))
+		} else if (WordIs(beg, len, "Ka")) {
+			if (!(line.Float(cur->amb.r) && line.Float(cur->amb.g) &&
+			      line.Float(cur->amb.b)))
 				goto handle_err;
-		} else if (word == "Ks") {
-			if (!(iss >> cur->spec.r >> cur->spec.g >> cur->spec.b))
+		} else if (WordIs(beg, len, "Kd")) {
+			if (!(line.Float(cur->diff.r) &&
+			      line.Float(cur->diff.g) &&
+			      line.Float(cur->diff.b)))
 				goto handle_err;
-		} else if (word == "map_Kd") {
-			if (!(iss >> word))
+		} else if (WordIs(beg, len, "Ks")) {
+			if (!(line.Float(cur->spec.r) &&
+			      line.Float(cur->spec.g) &&
+			      line.Float(cur->spec.b)))
 				goto handle_err;
-			if (cur->tex_img.Import(word.c_str()) < 0)
+		} else if (WordIs(beg, len, "map_Kd")) {
+			std::string word;
+			if (!line.Word(word))
 				goto handle_err;
-		} else if (word == "newmtl") {
-			if (!(iss >> word))
+			WfobjCacheDep dep;
+			PpmImg img;
+			if (StatWfobjCacheDep(word.c_str(), dep) < 0 ||
+			    img.Import(word.c_str()) < 0)
 				goto handle_err;
-			cur = &map[word];
+			cur->tex.Import(img, tex_fmt.layout, tex_fmt.mipmaps);
+			deps.push_back(dep);
 		}
 	}
 
 	return;
 
 handle_err:
-	throw std::runtime_error(
-		"could not parse line: " + line);
+	throw std::runtime_error("could not parse line: " +
+		std::string(line.p, line.end));
 }
 
-void ImportObjFile(char const *path, std::string &mtl_path,
-	std::unordered_map<std::string, Wfobj::Wfobj::Mesh> &map)
-{
-	std::ifstream in(path);
-	if (!in.is_open())
-		throw std::invalid_argument("Can not find file " +
-					std::string(path));
-	std::string line;
+/* Parse result of one chunk of lines, face corners are raw 1-based
+ * indices, resolved after all chunks are done */
+struct ObjChunk {
 	std::vector<Vec3> pos;
 	std::vector<Vec2> tex;
 	std::vector<Vec3> norm;
 
-	Wfobj::Mesh *cur;
+	std::vector<std::array<std::size_t, 3>> corners;
+	std::vector<uint32_t> face_size;
+
+	/* Faces from face_beg use mtl, the first group keeps the material
+	 * of the previous chunk if inherit is set */
+	struct Group {
+		std::string mtl;
+		bool inherit;
+		std::size_t face_beg;
+	};
+	std::vector<Group> groups;
+
+	std::string mtl_path;
+	std::string err_line;
+	bool err = false;
+
+	void Parse(char const *p, char const *end);
+};
+
+void ObjChunk::Parse(char const *p, char const *end)
+{
+	groups.push_back(Group{ "", true, 0 });
 
-	while (std::getline(in, line)) {
-		std::istringstream iss(line);
-		std::string word;
-		iss >> word;
-		if (word == "v") {
+	ObjLine line;
+	for (; p < end; p = line.end + 1) {
+		line = { p, FindLineEnd(p, end) };
+		char const *beg;
+		std::size_t len;
+		if (!line.Word(beg, len))
+			continue;
+		if (WordIs(beg, len, "v")) {
 			Vec3 v;
-			if (!(iss >> v.x >> v.y >> v.z))
+			if (!(line.Float(v.x) && line.Float(v.y) &&
+			      line.Float(v.z)))
 				goto handle_err;
 			pos.push_back(v);
-		} else if (word == "vt") {
+		} else if (WordIs(beg, len, "vt")) {
 			Vec2 v;
-			if (!(iss >> v.x >> v.y))
+			if (!(line.Float(v.x) && line.Float(v.y)))
 				goto handle_err;
 			tex.push_back(v);
-		} else if (word == "vn") {
+		} else if (WordIs(beg, len, "vn")) {
 			Vec3 v;
-			if (!(iss >> v.x >> v.y >> v.z))
+			if (!(line.Float(v.x) && line.Float(v.y) &&
+			      line.Float(v.z)))
 				goto handle_err;
 			norm.push_back(v);
-		} else if (word == "f") {
-			std::size_t idx[3];
+		} else if (WordIs(beg, len, "f")) {
+			/* pos/tex/norm, separators are not checked */
+			std::array<std::size_t, 3> idx;
 			char trash;
-			auto const vsize = cur->verts.size();
-			while (iss >> idx[0] >> trash >> idx[1] >> trash >> idx[2]) {
-				cur->verts.push_back({ pos[idx[0] - 1],
-						       tex[idx[1] - 1],
-						       norm[idx[2] - 1] });
+			uint32_t n = 0;
+			while (line.Uint(idx[0]) && line.Char(trash) &&
+			       line.Uint(idx[1]) && line.Char(trash) &&
+			       line.Uint(idx[2])) {
+				corners.push_back(idx);
+				++n;
 			}
-			auto const vcount = cur->verts.size() - vsize;
-			for (auto i = 1u; i < vcount - 1; i++) {
-				cur->inds.push_back(vsize);
-				cur->inds.push_back(vsize + i);
-				cur->inds.push_back(vsize + i + 1);
-			}
-		} else if (word == "usemtl") {
-			if (!(iss >> word))
+			face_size.push_back(n);
+		} else if (WordIs(beg, len, "usemtl")) {
+			std::string word;
+			if (!line.Word(word))
 				goto handle_err;
-			cur = &map[word];
-		} else if (word == "mtllib") {
-			if (!(iss >> word))
+			groups.push_back(Group{ word, false, face_size.size() });
+		} else if (WordIs(beg, len, "mtllib")) {
+			if (!line.Word(mtl_path))
 				goto handle_err;
-			mtl_path = word;
 		}
 	}
 	return;
 
 handle_err:
-	throw std::runtime_error(
-		"could not parse line: " + line);
+	err = true;
+	err_line.assign(line.p, line.end);
+}
+
+struct CornerHash {
+	std::size_t operator()(std::array<std::size_t, 3> const &idx) const
+	{
+		return idx[0] * 0x9e3779b97f4a7c15 ^
+		       idx[1] * 0xc2b2ae3d27d4eb4f ^
+		       idx[2] * 0x165667b19e3779f9;
+	}
+};
+using CornerMap = std::unordered_map<std::array<std::size_t, 3>,
+	Wfobj::Mesh::Index, CornerHash>;
+
+void ImportObjFile(char const *path, std::string &mtl_path,
+	std::unordered_map<std::string, Wfobj::Wfobj::Mesh> &map)
+{
+	MmapFile file;
+	if (file.Map(path) < 0)
+		throw std::invalid_argument("Can not find file " +
+					std::string(path));
+
+	/* Chunks start after a newline, one per thread for big files */
+	std::size_t const min_chunk = 1 << 20;
+	std::size_t n_chunks = std::max<std::size_t>(1, std::min<std::size_t>(
+		std::thread::hardware_concurrency(), file.size / min_chunk));
+	std::vector<char const *> bounds(n_chunks + 1);
+	char const *file_end = file.data + file.size;
+	bounds[0] = file.data;
+	bounds[n_chunks] = file_end;
+	for (std::size_t i = 1; i < n_chunks; ++i) {
+		char const *p = file.data + file.size * i / n_chunks;
+		p = std::max(p, bounds[i - 1]);
+		p = FindLineEnd(p, file_end);
+		bounds[i] = p < file_end ? p + 1 : file_end;
+	}
+
+	std::vector<ObjChunk> chunks(n_chunks);
+	std::vector<std::thread> threads;
+	for (std::size_t i = 1; i < n_chunks; ++i)
+		threads.emplace_back(&ObjChunk::Parse, &chunks[i],
+				     bounds[i], bounds[i + 1]);
+	chunks[0].Parse(bounds[0], bounds[1]);
+	for (auto &thread : threads)
+		thread.join();
+
+	std::vector<Vec3> pos;
+	std::vector<Vec2> tex;
+	std::vector<Vec3> norm;
+	for (auto &chunk : chunks) {
+		if (chunk.err)
+			throw std::runtime_error("could not parse line: " +
+						 chunk.err_line);
+		pos.insert(pos.end(), chunk.pos.begin(), chunk.pos.end());
+		tex.insert(tex.end(), chunk.tex.begin(), chunk.tex.end());
+		norm.insert(norm.end(), chunk.norm.begin(), chunk.norm.end());
+		if (!chunk.mtl_path.empty())
+			mtl_path = chunk.mtl_path;
+	}
+
+	/* Corners with the same pos/tex/norm share one vertex per mesh */
+	std::unordered_map<Wfobj::Mesh *, CornerMap> corner_maps;
+	Wfobj::Mesh *cur = nullptr;
+	CornerMap *cur_corners = nullptr;
+	std::vector<Wfobj::Mesh::Index> face;
+	for (auto const &chunk : chunks) {
+		std::size_t corner = 0;
+		for (std::size_t g = 0; g < chunk.groups.size(); ++g) {
+			auto const &group = chunk.groups[g];
+			if (!group.inherit) {
+				cur = &map[group.mtl];
+				cur_corners = &corner_maps[cur];
+			}
+			std::size_t face_end = g + 1 < chunk.groups.size() ?
+				chunk.groups[g + 1].face_beg :
+				chunk.face_size.size();
+			for (std::size_t f = group.face_beg; f < face_end; ++f) {
+				uint32_t n = chunk.face_size[f];
+				if (!cur)
+					throw std::runtime_error(
+						"face without usemtl");
+				face.clear();
+				for (uint32_t i = 0; i < n; ++i, ++corner) {
+					auto const &idx = chunk.corners[corner];
+					if (idx[0] - 1 >= pos.size() ||
+					    idx[1] - 1 >= tex.size() ||
+					    idx[2] - 1 >= norm.size())
+						throw std::runtime_error(
+							"bad face index");
+					auto ins = cur_corners->emplace(idx,
+						cur->verts.size());
+					if (ins.second) {
+						if (cur->verts.size() > UINT32_MAX)
+							throw std::runtime_error(
+								"too many vertices");
+						cur->verts.push_back({
+							pos[idx[0] - 1],
+							tex[idx[1] - 1],
+							norm[idx[2] - 1] });
+					}
+					face.push_back(ins.first->second);
+				}
+				for (auto i = 1u; i + 1 < n; i++) {
+					cur->inds.push_back(face[0]);
+					cur->inds.push_back(face[i]);
+					cur->inds.push_back(face[i + 1]);
+				}
+			}
+		}
+	}
 }
 
-int ImportWfobj(const char *obj, std::vector<Wfobj> &vec)
+int ImportWfobj(const char *obj, std::vector<Wfobj> &vec,
+		WfobjTexFormat tex_fmt)
 {
 	std::unordered_map<std::string, Wfobj::Mesh> map_mesh;
 	std::unordered_map<std::string, Wfobj::Mtl>  map_mtl;
+	std::string cache_path = std::string(obj) + WFOBJ_CACHE_EXT;
+	if (!LoadWfobjCache(cache_path.c_str(), vec, tex_fmt))
+		return 0;
+
+	auto const n_prev = vec.size();
 	try {
 		std::string mtl_path;
+		/* Stated before each read, an edit while parsing leaves
+		 * the cache out of date */
+		std::vector<WfobjCacheDep> deps(2);
+		if (StatWfobjCacheDep(obj, deps[0]) < 0)
+			return -1;
 		ImportObjFile(obj, mtl_path, map_mesh);
-		ImportMtlFile(mtl_path.c_str(), map_mtl);
+		if (StatWfobjCacheDep(mtl_path.c_str(), deps[1]) < 0)
+			return -1;
+		ImportMtlFile(mtl_path.c_str(), map_mtl, deps, tex_fmt);
 		if (map_mesh.size() != map_mtl.size())
 			return -1;
 
@@ -150,6 +473,9 @@ int ImportWfobj(const char *obj, std::vector<Wfobj> &vec)
 			tmp.mtl = map_mtl.at(e.first);
 			vec.push_back(tmp);
 		}
+		/* Failure only costs the next start a parse */
+		StoreWfobjCache(cache_path.c_str(), &vec[n_prev],
+				vec.size() - n_prev, deps, tex_fmt);
 	} catch (...) {
 		return -1;
 	}
@@ -0,0 +1,249 @@
+extern "C" {
+#include <sys/types.h>
+#include <sys/stat.h>
+};
+
+#include <include/wfobj.h>
+#include <include/mmap_file.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+/* Layout, all sections 8-byte aligned, native byte order:
+ *   CacheHdr
+ *   CacheDep + path                   x n_deps
+ *   CacheObj + name, level sizes, verts, inds, texels x n_objs
+ * Texels are the texture levels in tex_layout, as Texture::Import lays
+ * them out, so loading does no conversion
+ */
+static char const cache_magic[8] = { 'W', 'F', 'O', 'B', 'J', 'C', 'C', 0 };
+static uint32_t const cache_version = 4;
+
+struct CacheHdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t vertex_size;
+	uint32_t index_size;
+	uint32_t texel_size;
+	uint32_t n_deps;
+	uint32_t n_objs;
+	uint32_t tex_layout;
+	uint32_t tex_mipmaps;
+	uint64_t file_size;
+};
+
+struct CacheDep {
+	uint64_t size;
+	int64_t mtime_ns;
+	uint32_t path_len;
+	uint32_t pad;
+};
+
+struct CacheObj {
+	uint32_t name_len;
+	int32_t illum;
+	Wfobj::Mtl::Color_intens amb, diff, spec;
+	float ns;
+	uint32_t tex_w;
+	uint32_t tex_h;
+	uint32_t tex_levels;
+	uint64_t n_verts;
+	uint64_t n_inds;
+	uint64_t n_texels;
+};
+
+static std::size_t Align8(std::size_t size)
+{
+	return (size + 7) & ~std::size_t(7);
+}
+
+int StatWfobjCacheDep(char const *path, WfobjCacheDep &dep)
+{
+	struct stat st;
+	if (stat(path, &st) < 0)
+		return -1;
+	dep.path = path;
+	dep.size = st.st_size;
+	dep.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 +
+		       st.st_mtim.tv_nsec;
+	return 0;
+}
+
+/* Bounds checked reader over the mapping */
+struct CacheReader {
+	char const *p;
+	char const *end;
+
+	template <typename T>
+	T const *Get(std::size_t n = 1)
+	{
+		std::size_t left = end - p;
+		if (n > left / sizeof(T) || left < Align8(sizeof(T) * n))
+			return nullptr;
+		T const *ptr = reinterpret_cast<T const *>(p);
+		p += Align8(sizeof(T) * n);
+		return ptr;
+	}
+};
+
+int LoadWfobjCache(char const *cache_path, std::vector<Wfobj> &vec,
+	WfobjTexFormat tex_fmt)
+{
+	MmapFile file;
+	if (file.Map(cache_path) < 0)
+		return -1;
+	CacheReader rd = { file.data, file.data + file.size };
+	std::vector<Wfobj> objs;
+
+	auto hdr = rd.Get<CacheHdr>();
+	if (!hdr || memcmp(hdr->magic, cache_magic, sizeof(cache_magic)) ||
+	    hdr->version != cache_version ||
+	    hdr->vertex_size != sizeof(Vertex) ||
+	    hdr->index_size != sizeof(Wfobj::Mesh::Index) ||
+	    hdr->texel_size != sizeof(Texture::Color) ||
+	    hdr->tex_layout != uint32_t(tex_fmt.layout) ||
+	    hdr->tex_mipmaps != tex_fmt.mipmaps ||
+	    hdr->file_size != file.size)
+		return -1;
+
+	for (uint32_t i = 0; i < hdr->n_deps; ++i) {
+		auto dep = rd.Get<CacheDep>();
+		if (!dep)
+			return -1;
+		auto path = rd.Get<char>(dep->path_len);
+		if (!path)
+			return -1;
+		WfobjCacheDep cur;
+		std::string path_str(path, dep->path_len);
+		if (StatWfobjCacheDep(path_str.c_str(), cur) < 0 ||
+		    cur.size != dep->size || cur.mtime_ns != dep->mtime_ns)
+			return -1;
+	}
+
+	objs.resize(hdr->n_objs);
+	for (auto &obj : objs) {
+		auto co = rd.Get<CacheObj>();
+		if (!co)
+			return -1;
+		auto name = rd.Get<char>(co->name_len);
+		auto lvl_size = rd.Get<uint32_t[2]>(co->tex_levels);
+		auto verts = rd.Get<Vertex>(co->n_verts);
+		auto inds = rd.Get<Wfobj::Mesh::Index>(co->n_inds);
+		auto texels = rd.Get<Texture::Color>(co->n_texels);
+		if (!name || !lvl_size || !verts || !inds || !texels)
+			return -1;
+		/* Sizes are used unchecked by the shaders */
+		if (co->n_inds % 3 ||
+		    !obj.mtl.tex.Assign(tex_fmt.layout, co->tex_w, co->tex_h,
+					co->tex_levels, lvl_size, texels,
+					co->n_texels))
+			return -1;
+		for (uint64_t j = 0; j < co->n_inds; ++j)
+			if (inds[j] >= co->n_verts)
+				return -1;
+
+		obj.name.assign(name, co->name_len);
+		obj.mesh.verts.assign(verts, verts + co->n_verts);
+		obj.mesh.inds.assign(inds, inds + co->n_inds);
+
+		auto &mtl = obj.mtl;
+		mtl.illum = static_cast<Wfobj::Mtl::IllumType> (co->illum);
+		mtl.amb = co->amb;
+		mtl.diff = co->diff;
+		mtl.spec = co->spec;
+		mtl.ns = co->ns;
+	}
+
+	vec.insert(vec.end(), std::make_move_iterator(objs.begin()),
+		   std::make_move_iterator(objs.end()));
+	return 0;
+}
+
+template <typename T>
+static void Put(std::ofstream &out, T const *data, std::size_t n = 1)
+{
+	static char const zeros[8] = {};
+	std::size_t size = sizeof(T) * n;
+	out.write(reinterpret_cast<char const *>(data), size);
+	out.write(zeros, Align8(size) - size);
+}
+
+int StoreWfobjCache(char const *cache_path, Wfobj const *objs,
+	std::size_t n_objs, std::vector<WfobjCacheDep> const &deps,
+	WfobjTexFormat tex_fmt)
+{
+	/* Written aside and renamed, readers never see a partial file */
+	std::string tmp_path = std::string(cache_path) + ".tmp";
+	std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+		return -1;
+
+	CacheHdr hdr = {};
+	memcpy(hdr.magic, cache_magic, sizeof(cache_magic));
+	hdr.version = cache_version;
+	hdr.vertex_size = sizeof(Vertex);
+	hdr.index_size = sizeof(Wfobj::Mesh::Index);
+	hdr.texel_size = sizeof(Texture::Color);
+	hdr.n_deps = deps.size();
+	hdr.n_objs = n_objs;
+	hdr.tex_layout = uint32_t(tex_fmt.layout);
+	hdr.tex_mipmaps = tex_fmt.mipmaps;
+	/* Patched once the size is known */
+	Put(out, &hdr);
+
+	for (auto const &d : deps) {
+		CacheDep dep = {};
+		dep.size = d.size;
+		dep.mtime_ns = d.mtime_ns;
+		dep.path_len = d.path.size();
+		Put(out, &dep);
+		Put(out, d.path.data(), d.path.size());
+	}
+
+	for (std::size_t i = 0; i < n_objs; ++i) {
+		auto const &obj = objs[i];
+		auto const &mtl = obj.mtl;
+		CacheObj co = {};
+		co.name_len = obj.name.size();
+		co.illum = static_cast<int32_t> (mtl.illum);
+		co.amb = mtl.amb;
+		co.diff = mtl.diff;
+		co.spec = mtl.spec;
+		co.ns = mtl.ns;
+		uint32_t lvl_size[Texture::MAX_LEVELS][2] = {};
+		if (mtl.tex.n_levels) {
+			co.tex_w = mtl.tex.w;
+			co.tex_h = mtl.tex.h;
+			co.tex_levels = mtl.tex.n_levels;
+			for (uint32_t l = 0; l < co.tex_levels; ++l) {
+				lvl_size[l][0] = mtl.tex.lvl_w[l];
+				lvl_size[l][1] = mtl.tex.lvl_h[l];
+			}
+		}
+		co.n_verts = obj.mesh.verts.size();
+		co.n_inds = obj.mesh.inds.size();
+		co.n_texels = mtl.tex.buf.size();
+		Put(out, &co);
+		Put(out, obj.name.data(), obj.name.size());
+		Put(out, lvl_size, co.tex_levels);
+		Put(out, obj.mesh.verts.data(), obj.mesh.verts.size());
+		Put(out, obj.mesh.inds.data(), obj.mesh.inds.size());
+		Put(out, mtl.tex.buf.data(), mtl.tex.buf.size());
+	}
+
+	hdr.file_size = out.tellp();
+	out.seekp(0);
+	Put(out, &hdr);
+	out.close();
+	if (!out.good())
+		goto handle_err;
+
+	if (std::rename(tmp_path.c_str(), cache_path) < 0)
+		goto handle_err;
+	return 0;
+
+handle_err:
+	std::remove(tmp_path.c_str());
+	return -1;
+}